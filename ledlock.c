@@ -4,15 +4,8 @@ This file contains code which will allow for a timer device as described in
     Greg Kroah-Hartman which connects to a standard parallel port and reads
     port 0x378. 
 
-The itoa() function for converting an integer into a cstring is copyright of
-    the Free Software Foundation under GPLv2. Many iterations exist, but that
-    is the version I chose to use as opposed to rolling it from scratch.
 
 See the included README file for explanations beyond the comments herein.
-    
-    TODO: handle larger timer modulus
-    TODO: handle jiffy wrap
-    TODO: 32 bit jiffy reads
 */
 
 #include <linux/module.h>
@@ -29,86 +22,414 @@ See the included README file for explanations beyond the comments herein.
 #include <linux/slab.h>
 #include <linux/mm.h>
 #include <linux/interrupt.h>
-#include <linux/workqueue.h>
+#include <linux/hrtimer.h>  // display engine timer
+#include <linux/spinlock.h>
+#include <linux/seqlock.h>
+#include <linux/atomic.h>
 #include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/parport.h>
+#include <linux/kfifo.h>
+#include <linux/debugfs.h>
+#include <linux/mutex.h>
+#include <linux/cdev.h>
+#include <linux/list.h>
+#include <linux/seq_file.h>
+#include <linux/kthread.h>
+#include <linux/cpumask.h>
+#include <linux/rcupdate.h>
 
 #include "ledlock.h"
+#include "ledlock_core.h"
+
+#define CREATE_TRACE_POINTS
+#include "ledlock_trace.h"
 
 MODULE_AUTHOR ("Preston Hamlin");
 MODULE_LICENSE("Dual BSD/GPL");
 
-// segment bits
-#define SEG_B   0b00000001
-#define SEG_BL  0b00000010
-#define SEG_M   0b00000100
-#define SEG_BR  0b00001000
-#define SEG_T   0b00010000
-#define SEG_TR  0b00100000
-#define SEG_TL  0b01000000
-#define SEG_INT 0b10000000
-
-// digits
-#define L_DIGIT_0   (SEG_B | SEG_BL | SEG_TL | SEG_T | SEG_TR | SEG_BR)
-#define L_DIGIT_1   (SEG_TR | SEG_BR)
-#define L_DIGIT_2   (SEG_T | SEG_TR | SEG_M | SEG_BL | SEG_B)
-#define L_DIGIT_3   (SEG_T | SEG_TR | SEG_BR | SEG_M | SEG_B)
-#define L_DIGIT_4   (SEG_TL | SEG_M | SEG_TR | SEG_BR)
-#define L_DIGIT_5   (SEG_T | SEG_TL | SEG_M | SEG_BR | SEG_B)
-#define L_DIGIT_6   (SEG_T | SEG_TL | SEG_BL | SEG_B | SEG_BR | SEG_M)
-#define L_DIGIT_7   (SEG_T | SEG_TR | SEG_BR)
-#define L_DIGIT_8   (SEG_B | SEG_BL | SEG_TL | SEG_T | SEG_TR | SEG_BR | SEG_M)
-#define L_DIGIT_9   (SEG_B | SEG_TL | SEG_T | SEG_TR | SEG_BR | SEG_M)
+
+// most displays one module will drive
+#define LEDLOCK_MAX_DEVICES 8
+
+
+// everything a display program is compiled from
+struct ledlock_program_key {
+    u64 value;
+    unsigned int wrap;
+    unsigned int time_display;
+    unsigned int time_blank_digit;
+    unsigned int time_blank_value;
+};
+
+// A timed activity of one display, run from the shared timer. Works like the
+//  parts of an hrtimer the driver needs: the callback either moves expires on
+//  and returns HRTIMER_RESTART, or returns HRTIMER_NORESTART.
+struct ledlock_timer {
+    struct list_head node;      // on ledlock_wheel_list while pending
+    ktime_t expires;
+    enum hrtimer_restart (*fn)(struct ledlock_timer *timer);
+    ktime_t restart;            // started while its callback ran, for when
+    bool restarting;            //  the callback returns
+};
+
+// running lateness figures, for debugfs
+struct ledlock_stat {
+    u64 samples;
+    u64 total_ns;
+    u64 max_ns;
+};
+
+// Running counts of what a display has been up to, for debugfs, where a
+//  write to the stats file resets them. The first group only changes from
+//  the display's timers, the rest from any caller, hence the atomics. An
+//  increment that races with a reset may survive it.
+struct ledlock_counters {
+    u64 frames;                         // frames shown, engine and stream
+    u64 port_writes;                    // bytes sent to the backend
+    u64 port_suppressed;                // ... and not, as already there
+    u64 port_busy;                      // ... and not, as another driver had it
+    u64 skipped;                        // seconds of the count never shown
+    u64 wraps;                          // times the shown count went round
+    u64 misses;                         // engine steps over LEDLOCK_MISS_NS late
+    u64 wakeups;                        // timer callbacks run for the display
+    u64 overshoot_ns;                   // latest any engine step ran
+    u64 switches;                       // sessions shown in turn
+    u64 paused_ns;                      // time paused, up to the last unpause
+    u64 since_ns;                       // when these were last reset
+    atomic64_t reads;
+    atomic64_t writes;
+    atomic64_t ioctls;
+    atomic64_t seq_retries;             // counter_seq reads that had to retry
+    atomic64_t mutex_waits;             // stream_mutex found already held
+};
+
+// an engine step this late has eaten into the next, as no frame is shorter
+#define LEDLOCK_MISS_NS     NSEC_PER_MSEC
+
+// A timer session, a count of its own that the display shows whenever the
+//  scheduler picks it. While on show its counter lives in the device, where
+//  the engine expects it, and the copy here is stale; otherwise the copy
+//  here is the count, running on unseen. Kept under counter_seq.
+struct ledlock_session {
+    struct list_head node;              // on the device's sessions list
+    int priority;                       // highest written session is shown
+    unsigned int slice_ms;              // turn among equals, 0 for slice_ms
+    u64 count_cap;
+    u64 write_ns;
+    u64 pause_ns;
+    u64 pause_nsmarker;
+    int flags;                          // its LEDLOCK_SESSION_FLAGS
+};
+
+#define LEDLOCK_STREAM_FRAMES 1024
+#define LEDLOCK_SIM_RECORDS 4096
+
+// one display, with everything it needs to count and show on its own
+struct ledlock_dev {
+    int minor;
+    struct cdev cdev;
+    atomic_t state;                     // LEDLOCK_* flags, read without a lock
+
+    // The counter, its time markers and the timing values are published under
+    //  a seqlock, so readers never block on the display engine; they just
+    //  retry if it was mid-update. Flag changes that must land together with
+    //  any of these are made inside the same write section.
+    seqlock_t counter_seq;
+    u64 count;                          // value being displayed
+    u64 count_cap;
+    unsigned int time_display;          // AKA "dwell time"
+    unsigned int time_blank_digit;      // time inbetween digits
+    unsigned int time_blank_value;      // time between digit sequences
+
+    // time markers, in CLOCK_MONOTONIC ns
+    u64 write_ns;                       // marks time of last write
+    u64 pause_ns;                       // total time paused since the write
+    u64 pause_nsmarker;                 // measures pause duration
+
+    char last_digit;                    // on the port, for the status page
+
+    // poll support, each event source bumps its sequence number and wakes
+    //  waitq, and each open file remembers the last numbers it saw
+    wait_queue_head_t waitq;
+    struct ledlock_timer tick_timer;
+    atomic_t ticks;                     // count changed
+    atomic_t cap_events;                // cap reached or wrapped
+    atomic_t pause_events;              // paused or unpaused
+    u64 tick_seconds;                   // elapsed as of the last tick
+
+    // timer sessions, see struct ledlock_session, under counter_seq
+    struct ledlock_session shared;      // for files without one of their own
+    struct list_head sessions;          // every session, shared included
+    struct ledlock_session *on_show;    // whose counter the device holds
+    struct ledlock_timer slice_timer;   // ends its turn among equals
+    bool slicing;                       // ... and is armed
+
+    // stream mode, frames queued by write() and played from stream_timer
+    //  Writers are serialised by the mutex, the timer is the only reader. Room
+    //  in the queue is signalled on waitq like the poll events.
+    DECLARE_KFIFO(stream_fifo, struct ledlock_frame_record,
+                  LEDLOCK_STREAM_FRAMES);
+    struct mutex stream_mutex;
+    struct ledlock_timer stream_timer;
+    u64 stream_underruns;               // times the queue ran dry
+
+    // lap history, see struct ledlock_lap, filled by IOCTL_LEDLOCK_LAP from
+    //  any file and drained by IOCTL_LEDLOCK_LAPS
+    DECLARE_KFIFO(lap_fifo, struct ledlock_lap, LEDLOCK_LAP_RECORDS);
+    spinlock_t lap_lock;
+    u32 lap_seq;                        // number of the next lap
+    u64 laps_dropped;                   // laps lost to a full ring
+
+    // shared status page, see struct ledlock_status
+    struct ledlock_status *status;
+    spinlock_t status_lock;             // serializes publishers
+
+    // output, see the backends
+    unsigned long port;                 // I/O base for the port backend
+    int parport;                        // port number for the parport backend
+    struct pardevice __rcu *pardev;     // RCU, the port may be unplugged
+    spinlock_t pardev_lock;             // claimed and holding, vs preemption
+    bool claimed;                       // the parport is ours
+    bool holding;                       // ... and mid-sequence, so keep it
+    DECLARE_KFIFO_PTR(sim_fifo, struct ledlock_sim_record);
+    spinlock_t sim_lock;
+    u64 sim_dropped;                    // records overwritten before being read
+    struct dentry *debugfs;
+    int port_shadow;                    // byte on the port, or -1 if unknown
+    u64 port_write_ns;                  // when it was last really written
+
+    // display engine state, only touched from the engine timer
+    struct ledlock_timer timer;
+    struct ledlock_core_engine engine;  // see ledlock_core_step()
+    struct ledlock_program_key program_key;     // what it shows
+    u64 program_hits;                   // values replayed from the cache
+    u64 program_builds;                 // values compiled afresh
+    u64 bcd;                            // shown value, packed BCD
+    u64 bcd_value;                      // ... and as an integer
+    ktime_t due;                        // when the timer is next due
+    ktime_t second_due;                 // second boundary the timer is set for
+    struct ledlock_stat drift;          // lateness at second boundaries
+    u64 cmd_ns;                         // when a control command was posted
+    struct ledlock_stat latency;        // control command to output
+
+    struct ledlock_counters counters;
+};
+
+struct ledlock_file;
 
 int ledlock_open (struct inode* inode, struct file* fp);
 int ledlock_release (struct inode* inode, struct file* fp);
 
 ssize_t ledlock_read(struct file *fp, char __user *buffer, size_t count,
                     loff_t *pos);
-ssize_t ledlock_write(struct file *fp, char __user *buffer, size_t count,
-                     loff_t *pos);
+ssize_t ledlock_write(struct file *fp, const char __user *buffer,
+                      size_t count, loff_t *pos);
+
+__poll_t ledlock_poll(struct file *fp, poll_table *wait);
+int     ledlock_mmap(struct file *fp, struct vm_area_struct *vma);
 
-int     ledlock_ioctl(struct file* fp, unsigned int cmd, unsigned int arg);
+long    ledlock_ioctl(struct file* fp, unsigned int cmd, unsigned long arg);
 
 int     ledlock_init(void);
 void    ledlock_cleanup(void);
 
-void    ledlock_display_digit(char val);
-void    ledlock_display_clear(void);
-void    ledlock_display_value(void);
-void    itoa (char *buf, int base, int d);
+void    ledlock_display_digit(struct ledlock_dev *dev, char val);
+void    ledlock_display_clear(struct ledlock_dev *dev);
+void    ledlock_display_value(struct ledlock_dev *dev);
+static u64 ledlock_current_count(struct ledlock_dev *dev);
+static void ledlock_engine_kick(struct ledlock_dev *dev);
+static void ledlock_engine_restart(struct ledlock_dev *dev);
+static void ledlock_engine_post(struct ledlock_dev *dev);
+static void ledlock_tick_kick(struct ledlock_dev *dev);
+static void ledlock_tick_restart(struct ledlock_dev *dev);
+static void ledlock_notify(struct ledlock_dev *dev, atomic_t *events);
+static void ledlock_status_publish(struct ledlock_dev *dev);
+static ssize_t ledlock_stream_write(struct file *fp,
+                                    const char __user *buffer, size_t count);
+static void ledlock_timer_setup(struct ledlock_timer *timer,
+                    enum hrtimer_restart (*fn)(struct ledlock_timer *timer));
+static void ledlock_timer_start(struct ledlock_timer *timer, ktime_t expires);
+static void ledlock_timer_cancel(struct ledlock_timer *timer);
+static void ledlock_timer_try_to_cancel(struct ledlock_timer *timer);
+static void ledlock_port_yield(struct ledlock_dev *dev);
+static u64 ledlock_session_count(struct ledlock_dev *dev,
+                                 struct ledlock_session *ses);
+static u64 ledlock_session_elapsed(struct ledlock_dev *dev,
+                                   struct ledlock_session *ses, u64 now);
+static bool ledlock_schedule(struct ledlock_dev *dev, bool rotate);
+static void ledlock_session_close(struct ledlock_dev *dev,
+                                  struct ledlock_session *ses);
+static void ledlock_session_open(struct ledlock_file *lf,
+                                 const struct ledlock_session_config *cfg);
+
+
+
+// flags, kept together in each device's state so they can be read without a
+//  lock
+#define LEDLOCK_PAUSED      (1 << 0)
+#define LEDLOCK_WRAP        (1 << 1)
+#define LEDLOCK_DISPLAY     (1 << 2)
+#define LEDLOCK_SCHEDULE    (1 << 3)
+#define LEDLOCK_WRITTEN     (1 << 4)
+#define LEDLOCK_RUNNING     (1 << 5)    // display engine has its timer armed
+#define LEDLOCK_TICKING     (1 << 6)    // tick timer is armed for pollers
+#define LEDLOCK_STREAM      (1 << 7)    // write() queues frames, not a cap
+#define LEDLOCK_STREAMING   (1 << 8)    // stream timer is armed
+#define LEDLOCK_POKED       (1 << 9)    // control command for the engine
+#define LEDLOCK_RESTART     (1 << 10)   // engine to start a fresh sequence
+
+// the flags that belong to a timer session rather than the display
+#define LEDLOCK_SESSION_FLAGS (LEDLOCK_PAUSED | LEDLOCK_WRAP | LEDLOCK_WRITTEN)
 
-
-// flags
 static bool LEDLOCK_INITIALIZED = false;
-static bool LEDLOCK_PAUSED;
-static bool LEDLOCK_WRAP;
-static bool LEDLOCK_DISPLAY;
-static bool LEDLOCK_DISPLAY_BUSY;
-static bool LEDLOCK_SCHEDULE;
-
-static bool LEDLOCK_WRITTEN;
 
 // globals
-struct mutex state_mutex, counter_mutex;
-struct workqueue_struct * ledlock_wq;
-struct work_struct ledlock_work;
-static unsigned int LEDLOCK_COUNT;
-static unsigned int LEDLOCK_COUNT_CAP;
-static unsigned int LEDLOCK_TIME_DISPLAY;       // AKA "dwell time"
-static unsigned int LEDLOCK_TIME_BLANK_DIGIT;   // time inbetween digits
-static unsigned int LEDLOCK_TIME_BLANK_VALUE;   // time between digit sequences
+static struct ledlock_dev *ledlock_devs;        // one per minor
+static dev_t ledlock_devt;                      // first of our device numbers
+
+struct ledlock_file {
+    struct ledlock_dev *dev;
+    struct ledlock_session *ses;        // the shared one, or else session
+    struct ledlock_session session;
+    int ticks;
+    int cap_events;
+    int pause_events;
+};
+
+// the shared timer, armed for the soonest pending ledlock_timer of any device
+static struct hrtimer ledlock_wheel;
+static LIST_HEAD(ledlock_wheel_list);           // pending, soonest first
+static DEFINE_SPINLOCK(ledlock_wheel_lock);
+static struct ledlock_timer *ledlock_wheel_running; // callback in progress
+static DECLARE_WAIT_QUEUE_HEAD(ledlock_wheel_idle);  // ... and who waits on it
+static u64 ledlock_wheel_wakeups;               // times the hrtimer fired
+
+// where the shared timer runs its timers, see the engine parameter
+enum ledlock_context {
+    LEDLOCK_CTX_IRQ,            // straight from the hrtimer interrupt
+    LEDLOCK_CTX_SOFTIRQ,        // from the hrtimer softirq
+    LEDLOCK_CTX_THREAD,         // from a kthread the hrtimer wakes
+};
+
+static const char * const ledlock_contexts[] = { "irq", "softirq", "thread" };
+
+static enum ledlock_context ledlock_wheel_context;
+static enum hrtimer_mode ledlock_wheel_mode;
+static struct task_struct *ledlock_wheel_thread;
+static atomic_t ledlock_wheel_kicked;           // thread has timers to run
+static cpumask_var_t ledlock_wheel_cpus;        // where the thread may run
+
+// output backend, chosen at load time and shared by every display
+struct ledlock_backend {
+    const char *name;
+    int  (*probe)(void);                        // optional, before any init
+    void (*remove)(void);                       // optional, after every exit
+    int  (*init)(struct ledlock_dev *dev);
+    void (*exit)(struct ledlock_dev *dev);
+    void (*write)(struct ledlock_dev *dev, unsigned char val);
+    void (*debugfs)(struct ledlock_dev *dev);   // optional extra debugfs files
+    bool (*claim)(struct ledlock_dev *dev);     // optional, may write now?
+    void (*yield)(struct ledlock_dev *dev);     // optional, between sequences
+};
+
+static const struct ledlock_backend *ledlock_backend;
+static struct dentry *ledlock_debugfs;
+
+static int devices = 1;
+module_param(devices, int, 0444);
+MODULE_PARM_DESC(devices, "number of displays, at least one per port given");
+
+static char *backend = "port";
+module_param(backend, charp, 0444);
+MODULE_PARM_DESC(backend, "output backend: port, parport or sim");
+
+static unsigned long port[LEDLOCK_MAX_DEVICES] = { 0x378, 0x278, 0x3bc };
+static int nport;
+module_param_array(port, ulong, &nport, 0444);
+MODULE_PARM_DESC(port, "I/O base of each display for the port backend");
+
+static int parport[LEDLOCK_MAX_DEVICES] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+static int nparport;
+module_param_array(parport, int, &nparport, 0444);
+MODULE_PARM_DESC(parport, "parport number of each display for the parport "
+                          "backend");
+
+static bool parport_excl;
+module_param(parport_excl, bool, 0444);
+MODULE_PARM_DESC(parport_excl, "register on the parport exclusively, so no "
+                               "other driver can use it, rather than share it");
+
+static char *engine = "irq";
+module_param(engine, charp, 0444);
+MODULE_PARM_DESC(engine, "where display timers run: irq, softirq or thread");
+
+static char *cpus = "";
+module_param(cpus, charp, 0444);
+MODULE_PARM_DESC(cpus, "CPUs the engine thread may run on, as a list such as "
+                       "0-1,4, or any if empty");
+
+static bool rt;
+module_param(rt, bool, 0444);
+MODULE_PARM_DESC(rt, "run the engine thread SCHED_FIFO rather than "
+                     "SCHED_NORMAL");
+
+static unsigned int slack_us;
+module_param(slack_us, uint, 0444);
+MODULE_PARM_DESC(slack_us, "how late a timer may fire so the kernel can batch "
+                           "it with others, 0 for hard timers");
+
+static unsigned int slice_ms = 5000;
+module_param(slice_ms, uint, 0644);
+MODULE_PARM_DESC(slice_ms, "how long each of several timer sessions of equal "
+                           "priority is shown in turn");
+
+static bool lap_overwrite;
+module_param(lap_overwrite, bool, 0644);
+MODULE_PARM_DESC(lap_overwrite, "when the lap ring is full, drop the oldest lap "
+                                "rather than the new one");
+
+static unsigned int refresh_ms;
+module_param(refresh_ms, uint, 0644);
+MODULE_PARM_DESC(refresh_ms, "rewrite an unchanged port once this long since "
+                             "its last write, 0 to never");
+
+static inline bool ledlock_test(struct ledlock_dev *dev, int flag) {
+    return atomic_read(&dev->state) & flag;
+}
+
+static inline void ledlock_set(struct ledlock_dev *dev, int flag) {
+    atomic_or(flag, &dev->state);
+}
+
+static inline void ledlock_clear(struct ledlock_dev *dev, int flag) {
+    atomic_andnot(flag, &dev->state);
+}
+
+// these return whether the flag was set beforehand
+static inline bool ledlock_test_and_set(struct ledlock_dev *dev, int flag) {
+    return atomic_fetch_or(flag, &dev->state) & flag;
+}
 
-static unsigned long LEDLOCK_WRITE_JMARKER;     // marks time of last write
-static unsigned long LEDLOCK_PAUSE_JCOUNT;      // jiffies elapsed while paused 
-static unsigned long LEDLOCK_PAUSE_JMARKER;     // measures pause duration 
+static inline bool ledlock_test_and_clear(struct ledlock_dev *dev, int flag) {
+    return atomic_fetch_andnot(flag, &dev->state) & flag;
+}
 
-char LEDLOCK_LAST_DIGIT;
+// read_seqretry() on counter_seq, counting the retries
+static inline bool ledlock_read_retry(struct ledlock_dev *dev,
+                                      unsigned int seq)
+{
+    if (!read_seqretry(&dev->counter_seq, seq)) return false;
+    atomic64_inc(&dev->counters.seq_retries);
+    return true;
+}
 
 struct file_operations ledlock_fops = {
     .owner      = THIS_MODULE,
     .read       = ledlock_read,
     .write      = ledlock_write,
-//    .poll       = ledlock_poll,
+    .poll       = ledlock_poll,
+    .mmap       = ledlock_mmap,
     .open       = ledlock_open,
     .release    = ledlock_release,
     .unlocked_ioctl      = ledlock_ioctl,
@@ -124,13 +445,33 @@ struct file_operations ledlock_fops = {
 //=============================================================================
 
 int ledlock_open (struct inode* inode, struct file* fp) {
-    printk("\tHey there, device opened.\n");
+    struct ledlock_dev *dev = container_of(inode->i_cdev, struct ledlock_dev,
+                                           cdev);
+    struct ledlock_file *lf;
+
+    pr_debug("\tHey there, device %d opened.\n", dev->minor);
+
+    // only events from here on are reported to this file
+    lf = kzalloc(sizeof(*lf), GFP_KERNEL);
+    if (!lf) return -ENOMEM;
+    lf->dev          = dev;
+    lf->ses          = &dev->shared;
+    lf->ticks        = atomic_read(&dev->ticks);
+    lf->cap_events   = atomic_read(&dev->cap_events);
+    lf->pause_events = atomic_read(&dev->pause_events);
+    fp->private_data = lf;
     
     return 0;
 }
 
 int ledlock_release (struct inode* inode, struct file* fp) {
-    printk("\tDevice released\n");
+    struct ledlock_file *lf = fp->private_data;
+
+    pr_debug("\tDevice released\n");
+
+    // a session of its own ends with the file
+    if (lf->ses != &lf->dev->shared) ledlock_session_close(lf->dev, lf->ses);
+    kfree(lf);
     
     return 0;
 }
@@ -145,505 +486,2342 @@ int ledlock_release (struct inode* inode, struct file* fp) {
 ssize_t ledlock_read(struct file *fp, char __user *buffer, size_t count,
                     loff_t *pos)
 {
-    unsigned int val;
+    struct ledlock_file *lf = fp->private_data;
+    struct ledlock_dev *dev = lf->dev;
+    unsigned int val32, seq;
+    u64 val;
     
+    atomic64_inc(&dev->counters.reads);
+
     // if invalid read attempt, fail
-    if (count != sizeof(unsigned int)) return -EINVAL;
+    if (count != sizeof(val32) && count != sizeof(val)) return -EINVAL;
     
-    // read timer value
-    mutex_lock(&counter_mutex);
-        copy_to_user(buffer, &LEDLOCK_COUNT, count);
-        val = LEDLOCK_COUNT;
-    mutex_unlock(&counter_mutex);
+    // work out the timer value as of now, which also acknowledges ticks
+    lf->ticks = atomic_read(&dev->ticks);
+    do {
+        seq = read_seqbegin(&dev->counter_seq);
+        val = ledlock_session_count(dev, lf->ses);
+    } while (ledlock_read_retry(dev, seq));
+
+    // a 32 bit read of a count that has outgrown it sticks at the top
+    if (count == sizeof(val32)) {
+        val32 = min_t(u64, val, UINT_MAX);
+        if (copy_to_user(buffer, &val32, count)) return -EFAULT;
+    }
+    else if (copy_to_user(buffer, &val, count)) return -EFAULT;
     
-    printk("\tRead timer: %u\n", val);
+    pr_debug("\tRead timer: %llu\n", val);
     return count;
 }
 
-ssize_t ledlock_write(struct file *fp, char __user *buffer, size_t count,
-                     loff_t *pos)
+ssize_t ledlock_write(struct file *fp, const char __user *buffer,
+                      size_t count, loff_t *pos)
 {
-    unsigned int val;
+    struct ledlock_file *lf = fp->private_data;
+    struct ledlock_dev *dev = lf->dev;
+    struct ledlock_session *ses;
+    unsigned int val32;
+    unsigned long flags;
+    u64 val, start = ktime_get_ns(), now;
+    bool shown;
     
+    atomic64_inc(&dev->counters.writes);
+    if (ledlock_test(dev, LEDLOCK_STREAM))
+        return ledlock_stream_write(fp, buffer, count);
+
     // if invalid write attempt, fail
-    if (count != sizeof(unsigned int)) return -EINVAL;
+    if (count == sizeof(val32)) {
+        if (copy_from_user(&val32, buffer, count)) return -EFAULT;
+        val = val32;
+    }
+    else if (count == sizeof(val)) {
+        if (copy_from_user(&val, buffer, count)) return -EFAULT;
+    }
+    else return -EINVAL;
         
-    // set new value for counter cap and reset counter, also reset time
-    mutex_lock(&counter_mutex);
-        LEDLOCK_COUNT = 0;
-        copy_from_user(&LEDLOCK_COUNT_CAP, buffer, count);
-        val = LEDLOCK_COUNT_CAP;
-        LEDLOCK_WRITE_JMARKER = jiffies;
-    mutex_unlock(&counter_mutex);
-    
-    mutex_lock(&state_mutex);
-        LEDLOCK_PAUSED = false;
-        LEDLOCK_WRITTEN = true;
-    mutex_unlock(&state_mutex);
+    // set new value for counter cap and reset counter, also reset time, on
+    //  the display if this file's session is on show
+    write_seqlock_irqsave(&dev->counter_seq, flags);
+        ses   = lf->ses;
+        shown = ses == dev->on_show;
+        now   = ktime_get_ns();
+        if (shown) {
+            dev->count_cap = val;
+            dev->write_ns = now;
+            dev->pause_ns = 0;
+            ledlock_clear(dev, LEDLOCK_PAUSED);
+            ledlock_set(dev, LEDLOCK_WRITTEN);
+            dev->tick_seconds = 0;
+        }
+        else {
+            ses->count_cap = val;
+            ses->write_ns  = now;
+            ses->pause_ns  = 0;
+            ses->flags     = (ses->flags & ~LEDLOCK_PAUSED) | LEDLOCK_WRITTEN;
+        }
+    write_sequnlock_irqrestore(&dev->counter_seq, flags);
+    trace_ledlock_write(dev->minor, val, start, now);
+    if (shown) {
+        ledlock_engine_restart(dev);
+        ledlock_notify(dev, &dev->ticks);
+        ledlock_tick_restart(dev);
+        ledlock_status_publish(dev);
+    }
+    ledlock_schedule(dev, false);      // a newly written session may go first
     
-    printk("\tNew counter cap: %u\n", val);
+    pr_debug("\tNew counter cap: %llu\n", val);
     return count;
 }
 
 
 
 //=============================================================================
-//                                  Helpers
+//                                  Poll
 //=============================================================================
 
+// Collects the events this file has not seen yet, as LEDLOCK_EVENT_* bits,
+//  optionally acknowledging them.
+static unsigned int ledlock_events(struct ledlock_file *lf, bool ack) {
+    struct ledlock_dev *dev = lf->dev;
+    int ticks        = atomic_read(&dev->ticks);
+    int cap_events   = atomic_read(&dev->cap_events);
+    int pause_events = atomic_read(&dev->pause_events);
+    unsigned int events = 0;
+
+    if (ticks != lf->ticks)               events |= LEDLOCK_EVENT_TICK;
+    if (cap_events != lf->cap_events)     events |= LEDLOCK_EVENT_CAP;
+    if (pause_events != lf->pause_events) events |= LEDLOCK_EVENT_PAUSE;
+
+    if (ack) {
+        lf->ticks        = ticks;
+        lf->cap_events   = cap_events;
+        lf->pause_events = pause_events;
+    }
+    return events;
+}
 
-// writes 8 bits to device
-//  does not reorder bits, just writes as-is
-void ledlock_display_digit(char val) {
-    LEDLOCK_LAST_DIGIT = val;
-    outb(val, 0x378);
+// A new count is readable (POLLIN) once per tick, until read. Cap and pause
+//  events are flagged as priority data (POLLPRI) until IOCTL_LEDLOCK_EVENTS
+//  collects them.
+__poll_t ledlock_poll(struct file *fp, poll_table *wait) {
+    struct ledlock_file *lf = fp->private_data;
+    struct ledlock_dev *dev = lf->dev;
+    unsigned int events;
+    __poll_t mask = 0;
+
+    poll_wait(fp, &dev->waitq, wait);
+
+    // a cap can always be written, frames only while there is room for them
+    if (!ledlock_test(dev, LEDLOCK_STREAM) ||
+        !kfifo_is_full(&dev->stream_fifo))
+        mask |= EPOLLOUT | EPOLLWRNORM;
+
+    // ticks are only generated while somebody is waiting for them
+    ledlock_tick_kick(dev);
+
+    events = ledlock_events(lf, false);
+    if (events & LEDLOCK_EVENT_TICK) mask |= EPOLLIN | EPOLLRDNORM;
+    if (events & (LEDLOCK_EVENT_CAP | LEDLOCK_EVENT_PAUSE)) mask |= EPOLLPRI;
+
+    return mask;
 }
 
-// same as above, but clears display
-void ledlock_display_clear(void) {
-    outb(0, 0x378);
-}
-
-// This function is to be scheduled repeatedly for display.
-// It reads timer count from global variable then displays each digit and will
-//  sleep as needed between each digit and after completion of the number. It
-//  will then schedule itself to be called again if need be. Although the
-//  structure of the function should prevent more than one instance running
-//  concurrently, the LEDLOCK_DISPLAY_BUSY flag will be used to prevent 
-//  simultanious writes to the device. If the driver is paused, the function
-//  will display the last digit and wait for the device to be unpaused before
-//  continuting where it left off.
-void ledlock_display_value(void) {
-    char digit_buffer[11], *p1;
-    int val;
-    long jcount;
-    bool paused, busy, display, wrap, schedule, written;
-    struct timeval t;
-    
-    printk("\tAttempting to display...\n");
-    
-    digit_buffer[10] = 0;   // terminate the cstring
-    p1 = digit_buffer;      // look at start of string
-    
-    // if paused, sleep until unpaused
-    mutex_lock(&state_mutex);
-        paused  = LEDLOCK_PAUSED;
-        busy    = LEDLOCK_DISPLAY_BUSY;
-        wrap    = LEDLOCK_WRAP;
-        written = LEDLOCK_WRITTEN;
-    mutex_unlock(&state_mutex);
-    
-    printk(wrap? "\t\tWrap\n" : "\t\tNoWrap\n");
-    
-    if (!written) return;   // if no data whatsoever, give up
-    if (busy) return;       // if another instance is displaying, give up
-    mutex_lock(&state_mutex);
-        LEDLOCK_DISPLAY_BUSY = true;
-    mutex_unlock(&state_mutex);
-    
-    while(paused) {
-        ledlock_display_digit(LEDLOCK_LAST_DIGIT);
-        msleep(50);
-        mutex_lock(&state_mutex);
-            paused  = LEDLOCK_PAUSED;
-        mutex_unlock(&state_mutex);
-        printk("\texternal pause...%X\n", LEDLOCK_LAST_DIGIT);
-    }
-    
-    
-    // update the counter, since we may have skipped over a number
-    // also, get the number to display
-    mutex_lock(&counter_mutex);
-        
-        val = jiffies_to_msecs(jiffies -
-                               (LEDLOCK_WRITE_JMARKER +
-                                LEDLOCK_PAUSE_JCOUNT)
-                               ) / 1000;
-        if (wrap) {
-            if (val >= LEDLOCK_COUNT_CAP) {
-                LEDLOCK_COUNT = val % LEDLOCK_COUNT_CAP;
-            }
-            else LEDLOCK_COUNT = val;
-        }
-        else {    // if not wrapping, get the minimum
-            LEDLOCK_COUNT = min(val, LEDLOCK_COUNT_CAP);
-            printk("\t\tWrap is off\n");
+
+
+//=============================================================================
+//                              Status Page
+//=============================================================================
+
+// maps the internal flags onto the LEDLOCK_STATUS_* bits userspace sees
+static unsigned int ledlock_status_flags(int state) {
+    return ((state & LEDLOCK_PAUSED)  ? LEDLOCK_STATUS_PAUSED  : 0) |
+           ((state & LEDLOCK_WRAP)    ? LEDLOCK_STATUS_WRAP    : 0) |
+           ((state & LEDLOCK_DISPLAY) ? LEDLOCK_STATUS_DISPLAY : 0) |
+           ((state & LEDLOCK_WRITTEN) ? LEDLOCK_STATUS_WRITTEN : 0) |
+           ((state & LEDLOCK_STREAM)  ? LEDLOCK_STATUS_STREAM  : 0);
+}
+
+// Refreshes the status page after anything it shows has changed. The page
+//  sequence is odd while an update is in progress, like a seqcount. Must not
+//  be called from inside a counter_seq write section.
+static void ledlock_status_publish(struct ledlock_dev *dev) {
+    struct ledlock_status *st = dev->status;
+    unsigned long flags;
+    unsigned int seq;
+    int state;
+
+    if (!st) return;
+
+    spin_lock_irqsave(&dev->status_lock, flags);
+        WRITE_ONCE(st->seq, st->seq + 1);
+        smp_wmb();
+
+        do {
+            seq = read_seqbegin(&dev->counter_seq);
+            state = atomic_read(&dev->state);
+            st->count          = ledlock_current_count(dev);
+            st->cap            = dev->count_cap;
+            st->write_ns       = dev->write_ns;
+            st->pause_ns       = dev->pause_ns;
+            st->pause_start_ns = dev->pause_nsmarker;
+        } while (ledlock_read_retry(dev, seq));
+
+        st->flags      = ledlock_status_flags(state);
+        st->last_digit = dev->last_digit;
+
+        smp_wmb();
+        WRITE_ONCE(st->seq, st->seq + 1);
+    spin_unlock_irqrestore(&dev->status_lock, flags);
+}
+
+// Maps the status page, read-only, so the timer can be sampled with plain
+//  loads instead of a read() per sample.
+int ledlock_mmap(struct file *fp, struct vm_area_struct *vma) {
+    struct ledlock_dev *dev = ((struct ledlock_file *)fp->private_data)->dev;
+
+    if (vma->vm_pgoff || vma->vm_end - vma->vm_start != PAGE_SIZE)
+        return -EINVAL;
+    if (vma->vm_flags & VM_WRITE) return -EPERM;
+    vm_flags_clear(vma, VM_MAYWRITE);
+
+    return remap_pfn_range(vma, vma->vm_start,
+                           virt_to_phys(dev->status) >> PAGE_SHIFT,
+                           PAGE_SIZE, vma->vm_page_prot);
+}
+
+
+
+//=============================================================================
+//                              Frame Stream
+//=============================================================================
+
+// starts the stream timer if it is not already running
+static void ledlock_stream_kick(struct ledlock_dev *dev) {
+    if (!ledlock_test_and_set(dev, LEDLOCK_STREAMING))
+        ledlock_timer_start(&dev->stream_timer, ktime_get());
+}
+
+// Queues whole frames, blocking while the queue is full unless the file is
+//  non-blocking. Returns the bytes taken, which may be fewer than offered.
+static ssize_t ledlock_stream_write(struct file *fp,
+                                    const char __user *buffer, size_t count)
+{
+    struct ledlock_dev *dev = ((struct ledlock_file *)fp->private_data)->dev;
+    unsigned int copied;
+    ssize_t result;
+
+    if (!count || count % sizeof(struct ledlock_frame_record)) return -EINVAL;
+
+    for (;;) {
+        if (!mutex_trylock(&dev->stream_mutex)) {
+            atomic64_inc(&dev->counters.mutex_waits);
+            if (mutex_lock_interruptible(&dev->stream_mutex))
+                return -ERESTARTSYS;
         }
-        val = LEDLOCK_COUNT;
-    mutex_unlock(&counter_mutex);
-    
-    
-    // fill buffer
-    itoa(digit_buffer, 'd', val);
-    printk("\t\tDisplaying: %u\n", val);
-    
-    while (*p1) {
-        mutex_lock(&state_mutex);
-            paused = LEDLOCK_PAUSED;
-        mutex_unlock(&state_mutex);
-        
-        // while paused, sleep
-        while(paused) {
-            ledlock_display_digit(LEDLOCK_LAST_DIGIT);
-            msleep(50);
-            printk("\tinternal pause...\n");
+        if (!ledlock_test(dev, LEDLOCK_STREAM)) {
+            result = -EINVAL;           // mode changed while we slept
+            break;
         }
-        
-        *p1 -= '0';
-        
-        // do not write to device if display is disabled
-        mutex_lock(&state_mutex);
-            display = LEDLOCK_DISPLAY;
-        mutex_unlock(&state_mutex);
-        
-        if (display) {
-            if      (*p1 == 0) ledlock_display_digit(L_DIGIT_0);
-            else if (*p1 == 1) ledlock_display_digit(L_DIGIT_1);
-            else if (*p1 == 2) ledlock_display_digit(L_DIGIT_2);
-            else if (*p1 == 3) ledlock_display_digit(L_DIGIT_3);
-            else if (*p1 == 4) ledlock_display_digit(L_DIGIT_4);
-            else if (*p1 == 5) ledlock_display_digit(L_DIGIT_5);
-            else if (*p1 == 6) ledlock_display_digit(L_DIGIT_6);
-            else if (*p1 == 7) ledlock_display_digit(L_DIGIT_7);
-            else if (*p1 == 8) ledlock_display_digit(L_DIGIT_8);
-            else if (*p1 == 9) ledlock_display_digit(L_DIGIT_9);
-            else {
-                printk("\nERROR: Bad digit buffer\n");
-                return;
+        if (!kfifo_is_full(&dev->stream_fifo)) {
+            result = kfifo_from_user(&dev->stream_fifo, buffer, count,
+                                     &copied);
+            if (!result) {
+                result = copied;
+                ledlock_stream_kick(dev);
             }
+            break;
         }
-        // sleep with digit displayed
-        msleep(LEDLOCK_TIME_DISPLAY);
-        
-        // sleep between digits, with blank display
-        if (wrap) ledlock_display_clear();
-        if (*(p1+1)) msleep(LEDLOCK_TIME_BLANK_DIGIT);
-        
-        ++p1;
+        mutex_unlock(&dev->stream_mutex);
+
+        if (fp->f_flags & O_NONBLOCK) return -EAGAIN;
+        if (wait_event_interruptible(dev->waitq,
+                                     !kfifo_is_full(&dev->stream_fifo) ||
+                                     !ledlock_test(dev, LEDLOCK_STREAM)))
+            return -ERESTARTSYS;
     }
-    
-    // sleep between values, with blank display
-    if (wrap) ledlock_display_clear();
-    msleep(LEDLOCK_TIME_BLANK_VALUE);
-       
-    // this instance is freeing the hardware
-    mutex_lock(&state_mutex);
-        LEDLOCK_DISPLAY_BUSY = false;
-    mutex_unlock(&state_mutex);
-    
-    printk("\tFinished displaying\n");
-}
+    mutex_unlock(&dev->stream_mutex);
 
+    return result;
+}
 
-void empty_helper(struct work_struct *work) {
-    bool schedule;
-    long jcount, mscount;
-    struct timeval t;
-    
-//    printk("\tInside helper callback that is scheduled\n");
-    
-    // schedule another value display, using fresh "current" time
-    mutex_lock(&state_mutex);
-        schedule = LEDLOCK_SCHEDULE;
-    mutex_unlock(&state_mutex);
-    if (schedule) {
-        queue_work(ledlock_wq, &ledlock_work);
-
-
-        //jcount = jiffies;
-        //mscount = ((jiffies_to_msecs(jiffies)+999)/1000) *1000;
-        jcount = jiffies_to_msecs(jiffies);
-        mscount = ((jcount+999)/1000) *1000 - jcount;
-        //printk("\t\tmscount: %ld\n", mscount);
-        //printk("\t\tjcount:  %ld - %ld\n", jcount, jiffies_to_msecs(jcount));
-        printk("\t\tsleep: %ld\n", mscount);
-        
-        msleep(mscount);
-//        jcount = msecs_to_jiffies((t.tv_sec +1)*1000); // round to next second
-//        printk("\t\t%ld : %ld\n", jiffies, jcount);
-//        schedule_delayed_work(&ledlock_work, jcount-jiffies);
-        
-        printk("\tScheduled\n");
-        ledlock_display_value();
+// Plays the next queued frame. The end of each frame is measured from when
+//  it was due rather than from when the timer got round to it, so frame
+//  lengths do not drift with timer latency. Parks once the queue runs dry.
+static enum hrtimer_restart ledlock_stream_fn(struct ledlock_timer *timer) {
+    struct ledlock_dev *dev = container_of(timer, struct ledlock_dev,
+                                           stream_timer);
+    struct ledlock_frame_record rec;
+
+    ++dev->counters.wakeups;
+    if (!ledlock_test(dev, LEDLOCK_SCHEDULE) ||
+        !ledlock_test(dev, LEDLOCK_STREAM)) {
+        ledlock_clear(dev, LEDLOCK_STREAMING);
+        return HRTIMER_NORESTART;
     }
-    else printk("No longer scheduling\n");
-};
 
+    if (!kfifo_get(&dev->stream_fifo, &rec)) {
+        // park, unless a writer queued a frame and saw us still running
+        ledlock_clear(dev, LEDLOCK_STREAMING);
+        if (kfifo_is_empty(&dev->stream_fifo) ||
+            ledlock_test_and_set(dev, LEDLOCK_STREAMING)) {
+            ++dev->stream_underruns;
+            wake_up_interruptible(&dev->waitq);
+            return HRTIMER_NORESTART;
+        }
+        timer->expires = ktime_get();
+        return HRTIMER_RESTART;
+    }
+    ledlock_display_digit(dev, rec.segments);
+    ledlock_port_yield(dev);            // frames, not sequences, here
+    ++dev->counters.frames;
+    if (trace_ledlock_frame_enabled())
+        trace_ledlock_frame(dev->minor, rec.segments, rec.duration_us,
+                            ktime_to_ns(timer->expires), ktime_get_ns());
+
+    // let writers back in once half the queue has drained, not every frame
+    if (kfifo_len(&dev->stream_fifo) == LEDLOCK_STREAM_FRAMES / 2)
+        wake_up_interruptible(&dev->waitq);
+
+    timer->expires = ktime_add_us(timer->expires, rec.duration_us);
+    return HRTIMER_RESTART;
+}
 
-/* Convert the integer D to a string and save the string in BUF. If
-        BASE is equal to 'd', interpret that D is decimal, and if BASE is
-        equal to 'x', interpret that D is hexadecimal. */
-void itoa (char *buf, int base, int d) {
-    char *p = buf;
-    char *p1, *p2;
-    unsigned long ud = d;
-    int divisor = 10;
+// Switches write() between taking a counter cap and streaming frames. Only
+//  one of the counter engine and the stream timer drives the port at a time,
+//  the other is stopped first. Leaving stream mode drops any queued frames.
+static int ledlock_set_mode(struct ledlock_dev *dev, unsigned int mode) {
+    if (mode != LEDLOCK_MODE_COUNT && mode != LEDLOCK_MODE_STREAM)
+        return -EINVAL;
 
-    /* If %d is specified and D is minus, put `-' in the head. */
-    if (base == 'd' && d < 0)
-        {
-            *p++ = '-';
-            buf++;
-            ud = -d;
+    if (!mutex_trylock(&dev->stream_mutex)) {
+        atomic64_inc(&dev->counters.mutex_waits);
+        mutex_lock(&dev->stream_mutex);
+    }
+    if (mode == LEDLOCK_MODE_STREAM) {
+        if (!ledlock_test_and_set(dev, LEDLOCK_STREAM)) {
+            ledlock_timer_cancel(&dev->timer);
+            ledlock_clear(dev, LEDLOCK_RUNNING);
+            dev->engine.phase = LEDLOCK_PHASE_WAIT;
+            ledlock_display_clear(dev);
+            ledlock_port_yield(dev);
         }
-    else if (base == 'x')
-        divisor = 16;
-
-    /* Divide UD by DIVISOR until UD == 0. */
-    do {
-        int remainder = ud % divisor;
+    }
+    else if (ledlock_test_and_clear(dev, LEDLOCK_STREAM)) {
+        ledlock_timer_cancel(&dev->stream_timer);
+        ledlock_clear(dev, LEDLOCK_STREAMING);
+        kfifo_reset(&dev->stream_fifo);
+        ledlock_display_clear(dev);
+        ledlock_port_yield(dev);
+        wake_up_interruptible(&dev->waitq);     // writers waiting for room
+        ledlock_engine_kick(dev);
+    }
+    mutex_unlock(&dev->stream_mutex);
 
-        *p++ = (remainder < 10) ? remainder + '0' : remainder + 'a' - 10;
-    } while (ud /= divisor);
+    return 0;
+}
 
-    /* Terminate BUF. */
-    *p = 0;
 
-    /* Reverse BUF. */
-    p1 = buf;
-    p2 = p - 1;
-    while (p1 < p2) {
-        char tmp = *p1;
-        *p1 = *p2;
-        *p2 = tmp;
-        p1++;
-        p2--;
-    }
-}
 
 //=============================================================================
-//                                  IOCTL
+//                              Output Backends
 //=============================================================================
 
-int ledlock_ioctl(struct file* fp, unsigned int cmd, unsigned int arg) {
-    bool paused;
-    
-    switch(cmd) {
-        case IOCTL_LEDLOCK_PON:     // pause timer
-            printk("\t\tIOCTL pause\n");
-            mutex_lock(&state_mutex);
-                paused = LEDLOCK_PAUSED;    // check if it was already paused
-                LEDLOCK_PAUSED = true;
-            mutex_unlock(&state_mutex);
-            
-            if (!paused) {  // mark time if not already paused
-                mutex_lock(&counter_mutex);
-                    LEDLOCK_PAUSE_JMARKER = jiffies;
-                mutex_unlock(&counter_mutex);
-            }
-            ledlock_display_digit(LEDLOCK_LAST_DIGIT);
-            break;
-            
-        case IOCTL_LEDLOCK_POFF:    // unpause timer
-            printk("\t\tIOCTL unpause\n");
-            mutex_lock(&state_mutex);
-                paused = LEDLOCK_PAUSED;
-                LEDLOCK_PAUSED = false;
-            mutex_unlock(&state_mutex);
-            
-            if (paused) {  // increment pause-counter if it was paused
-                mutex_lock(&counter_mutex);
-                    LEDLOCK_PAUSE_JCOUNT = jiffies - LEDLOCK_PAUSE_JMARKER;
-                mutex_unlock(&counter_mutex);
-            }
-            break;
-            
-        case IOCTL_LEDLOCK_DON:     // turn display on
-            printk("\t\tIOCTL display on\n");
-            mutex_lock(&state_mutex);
-                LEDLOCK_DISPLAY = true;
-            mutex_unlock(&state_mutex);
-            break;
-            
-        case IOCTL_LEDLOCK_DOFF:    // turn display off
-            printk("\t\tIOCTL display off\n");
-            mutex_lock(&state_mutex);
-                LEDLOCK_DISPLAY = false;
-            mutex_unlock(&state_mutex);
-            break;
-            
-        case IOCTL_LEDLOCK_WON:     // turn wrap on
-            printk("\t\tIOCTL wrap on\n");
-            mutex_lock(&state_mutex);
-                LEDLOCK_WRAP = true;
-            mutex_unlock(&state_mutex);
-            
-//            ledlock_display_value();
-            break;
-            
-        case IOCTL_LEDLOCK_WOFF:    // turn wrap off
-            printk("\t\tIOCTL wrap off\n");
-            mutex_lock(&state_mutex);
-                LEDLOCK_WRAP = false;
-            mutex_unlock(&state_mutex);
-            break;
+// Raw port I/O, as in the short driver. The registers are claimed with
+//  request_region(), so this fails to load rather than fight with lp or
+//  ppdev, though anything poking the port without claiming it still can.
+static int ledlock_port_init(struct ledlock_dev *dev) {
+    if (!dev->port) {
+        printk("ERROR: No port given for ledlock%d\n", dev->minor);
+        return -EINVAL;
+    }
 
-        case IOCTL_LEDLOCK_SHOW:    // set display length
-            printk("\t\tIOCTL set display length\n");
-            mutex_lock(&counter_mutex);
-                LEDLOCK_TIME_DISPLAY = arg;
-            mutex_unlock(&counter_mutex);
-            break;
-            
-        case IOCTL_LEDLOCK_BLANK_DIGIT:   // set digit blank length
-            printk("\t\tIOCTL set blank length\n");
-            mutex_lock(&counter_mutex);
-                LEDLOCK_TIME_BLANK_DIGIT = arg;
-            mutex_unlock(&counter_mutex);
-            break;
-        case IOCTL_LEDLOCK_BLANK_VALUE:   // set value blank length
-            printk("\t\tIOCTL set blank length\n");
-            mutex_lock(&counter_mutex);
-                LEDLOCK_TIME_BLANK_VALUE = arg;
-            mutex_unlock(&counter_mutex);
-            break;
+    // the data, status and control registers, so lp and ppdev keep off
+    if (!request_region(dev->port, 3, "ledlock")) {
+        printk("ERROR: Port 0x%lx is in use, try backend=parport\n",
+               dev->port);
+        return -EBUSY;
     }
-    
+    printk("ledlock%d using port 0x%lx\n", dev->minor, dev->port);
     return 0;
 }
 
+static void ledlock_port_exit(struct ledlock_dev *dev) {
+    release_region(dev->port, 3);
+}
 
+static void ledlock_port_write(struct ledlock_dev *dev, unsigned char val) {
+    outb(val, dev->port);
+}
 
-//=============================================================================
-//                              Init & Cleanup
-//=============================================================================
 
-int ledlock_init(void) {
-    int result;
-    
-    printk("\nInitializing ledlock module...\n");
-    if (LEDLOCK_INITIALIZED) {
-        printk("ERROR: Already initialized!\n");
-        return 1;
+// Parport subsystem. Each display claims its port on first writing to it and
+//  keeps it from then on, so showing a value costs no claim or release. The
+//  port is only given up between digit sequences: to another driver that
+//  asks for it then, and at the end of a sequence to any that asked during
+//  it. While another driver has it, the display's writes are dropped and
+//  the port is claimed back at the first write after it is let go, so a
+//  printer never stalls the display. With parport_excl the port is not
+//  shared at all, other drivers cannot even register on it. The timers use the pardevice under
+//  rcu_read_lock(), so an unplugged port waits them out before it goes.
+
+// Called when another driver wants the port we hold. Refuses mid-sequence,
+//  the other driver is then let in at the end of it.
+static int ledlock_parport_preempt(void *handle) {
+    struct ledlock_dev *dev = handle;
+    unsigned long flags;
+    int busy;
+
+    spin_lock_irqsave(&dev->pardev_lock, flags);
+        busy = dev->holding;
+        if (!busy) dev->claimed = false;
+    spin_unlock_irqrestore(&dev->pardev_lock, flags);
+    return busy;
+}
+
+static void ledlock_parport_attach(struct parport *pp) {
+    struct ledlock_dev *dev;
+    struct pardevice *pardev;
+    struct pardev_cb cb;
+    int i;
+
+    for (i = 0; i < devices; ++i) {
+        dev = &ledlock_devs[i];
+        if (pp->number != dev->parport || rcu_access_pointer(dev->pardev))
+            continue;
+
+        memset(&cb, 0, sizeof(cb));
+        cb.preempt = ledlock_parport_preempt;
+        cb.private = dev;
+        cb.flags   = parport_excl ? PARPORT_FLAG_EXCL : 0;
+        pardev = parport_register_dev_model(pp, "ledlock", &cb, i);
+        if (!pardev)
+            printk("ERROR: Cannot register on parport%d\n", dev->parport);
+        rcu_assign_pointer(dev->pardev, pardev);
     }
-    LEDLOCK_INITIALIZED = true;
+}
 
-    // register device
-    result = register_chrdev(LEDLOCK_MAJOR, "ledlock", &ledlock_fops);
-    if (result < 0) {
-        printk("ERROR: Cannot register device\n");
-        return result;
+static void ledlock_parport_detach(struct parport *pp) {
+    struct ledlock_dev *dev;
+    struct pardevice *pardev;
+    unsigned long flags;
+    bool claimed;
+    int i;
+
+    for (i = 0; i < devices; ++i) {
+        dev = &ledlock_devs[i];
+        pardev = rcu_dereference_protected(dev->pardev, true);
+        if (!pardev || pardev->port != pp) continue;
+
+        // no timer may still be writing, claiming or yielding through it,
+        //  and none left to claim it again once claimed is read
+        RCU_INIT_POINTER(dev->pardev, NULL);
+        synchronize_rcu();
+        spin_lock_irqsave(&dev->pardev_lock, flags);
+            claimed      = dev->claimed;
+            dev->claimed = dev->holding = false;
+        spin_unlock_irqrestore(&dev->pardev_lock, flags);
+        if (claimed) parport_release(pardev);
+        parport_unregister_device(pardev);
     }
+}
 
-    // clear bits
-    ledlock_display_clear();
+static struct parport_driver ledlock_parport_driver = {
+    .name       = "ledlock",
+    .match_port = ledlock_parport_attach,
+    .detach     = ledlock_parport_detach,
+};
 
-    // initialize mutexes
-    mutex_init(&state_mutex);
-    mutex_init(&counter_mutex);
-    
-    // initialize state
-    mutex_lock(&state_mutex);
-#if defined(WRAP) && defined(NOWRAP)
-#error "Only one of WRAP and NOWRAP can be defined at once"
-#elif defined(WRAP)
-        printk("WRAP defined\n");
-        LEDLOCK_WRAP = true;
-#elif defined(NOWRAP)
-        printk("NOWRAP defined\n");
-        LEDLOCK_WRAP = false;
-#else
-        LEDLOCK_WRAP = true;
-        printk("Default Wrap\n");
-#endif
+static int ledlock_parport_probe(void) {
+    return parport_register_driver(&ledlock_parport_driver);
+}
+
+static void ledlock_parport_remove(void) {
+    parport_unregister_driver(&ledlock_parport_driver);
+}
 
-        LEDLOCK_PAUSED          = true;
-        LEDLOCK_DISPLAY         = true; // pause will keep blank until write
-        LEDLOCK_DISPLAY_BUSY    = false;
-        LEDLOCK_SCHEDULE        = true;
-        LEDLOCK_WRITTEN         = false;
-        printk(LEDLOCK_WRAP ? "WRAP: T\n" : "WRAP: F\n"); 
-    mutex_unlock(&state_mutex);
+static int ledlock_parport_init(struct ledlock_dev *dev) {
+    if (!rcu_access_pointer(dev->pardev)) return -ENODEV;
+    printk("ledlock%d using parport%d%s\n", dev->minor, dev->parport,
+           parport_excl ? " exclusively" : "");
+    return 0;
+}
 
-    // initialize globals
-    mutex_lock(&counter_mutex);
-#ifdef DISPLAY
-        LEDLOCK_TIME_DISPLAY = DISPLAY;
-#else
-        LEDLOCK_TIME_DISPLAY = 200;
-#endif
-#ifdef BLANK_D
-        LEDLOCK_TIME_BLANK_DIGIT = BLANK_D;
-#else
-        LEDLOCK_TIME_BLANK_DIGIT = 50;
-#endif
-#ifdef BLANK_V
-        LEDLOCK_TIME_BLANK_VALUE = BLANK_V;
-#else
-        LEDLOCK_TIME_BLANK_VALUE = 200;
-#endif
-#if !defined(WRAP) && !defined(NOWRAP)
-        LEDLOCK_WRAP = true;
-#endif
-        LEDLOCK_COUNT           = 0;
-        LEDLOCK_COUNT_CAP       = 0;
-        
-        LEDLOCK_WRITE_JMARKER   = 0;
-        LEDLOCK_PAUSE_JCOUNT    = 0;
-        LEDLOCK_PAUSE_JMARKER   = 0;
-
-        printk("Display: %u\n", LEDLOCK_TIME_DISPLAY);
-        printk("BlankD: %u\n",  LEDLOCK_TIME_BLANK_DIGIT);
-        printk("BlankV: %u\n",  LEDLOCK_TIME_BLANK_VALUE);
-    mutex_unlock(&counter_mutex);
-    
-//    INIT_DELAYED_WORK(&ledlock_work, ledlock_display_value);
-//    schedule_delayed_work(&ledlock_work, 100);
+static void ledlock_parport_exit(struct ledlock_dev *dev) {
+}
 
-    ledlock_wq = create_workqueue("ledlock_workqueue");
-//    INIT_WORK(&ledlock_work, ledlock_display_value);
-//    queue_work(ledlock_wq, &ledlock_work);
-//    ledlock_display_value(NULL);
-    
-    INIT_WORK(&ledlock_work, empty_helper);
-    result = queue_work(ledlock_wq, &ledlock_work);
-//    if (result) printk("What!?\n");
-    
-    //ledlock_display_value();
+static void ledlock_parport_write(struct ledlock_dev *dev, unsigned char val) {
+    struct pardevice *pardev;
+
+    rcu_read_lock();
+        pardev = rcu_dereference(dev->pardev);
+        if (pardev) parport_write_data(pardev->port, val);
+    rcu_read_unlock();
+}
+
+// Makes sure the port is ours for the write about to be made, claiming it
+//  back if another driver has let it go, and holds on to it until the next
+//  yield. Never blocks, so it is safe from the timers.
+static bool ledlock_parport_claim(struct ledlock_dev *dev) {
+    struct pardevice *pardev;
+    unsigned long flags;
+    bool ours = false;
+
+    rcu_read_lock();
+        pardev = rcu_dereference(dev->pardev);
+        if (pardev) {
+            spin_lock_irqsave(&dev->pardev_lock, flags);
+                if (!dev->claimed && !parport_claim(pardev)) {
+                    dev->claimed     = true;
+                    dev->port_shadow = -1;  // the other driver had it
+                }
+                dev->holding = ours = dev->claimed;
+            spin_unlock_irqrestore(&dev->pardev_lock, flags);
+        }
+    rcu_read_unlock();
+    return ours;
+}
 
-    printk("Module initialized!\n");
+// End of a sequence: parport_yield() lets go of the port if somebody has
+//  been waiting for it and tries to take it straight back, which fails if
+//  they got it. Else the port is kept, but the next driver to ask has it.
+static void ledlock_parport_yield(struct ledlock_dev *dev) {
+    struct pardevice *pardev;
+    unsigned long flags;
+
+    rcu_read_lock();
+        pardev = rcu_dereference(dev->pardev);
+        if (pardev) {
+            spin_lock_irqsave(&dev->pardev_lock, flags);
+                dev->holding = false;
+                if (dev->claimed && parport_yield(pardev))
+                    dev->claimed = false;
+            spin_unlock_irqrestore(&dev->pardev_lock, flags);
+        }
+    rcu_read_unlock();
+}
+
+
+// Simulated port. Every byte written is recorded with a timestamp in a ring
+//  buffer, the oldest records being dropped when it fills. The records are
+//  drained from debugfs as struct ledlock_sim_record.
+static int ledlock_sim_init(struct ledlock_dev *dev) {
+    int result;
+
+    result = kfifo_alloc(&dev->sim_fifo, LEDLOCK_SIM_RECORDS, GFP_KERNEL);
+    if (result) return result;
+    spin_lock_init(&dev->sim_lock);
+    dev->sim_dropped = 0;
+    printk("ledlock%d using simulated port\n", dev->minor);
     return 0;
 }
 
+static void ledlock_sim_write(struct ledlock_dev *dev, unsigned char val) {
+    struct ledlock_sim_record rec;
+    unsigned long flags;
 
-void ledlock_cleanup(void) {
-    printk("Removing ledlock module...\n");
+    memset(&rec, 0, sizeof(rec));
+    rec.time_ns  = ktime_get_ns();
+    rec.segments = val;
 
-    // stop further scheduling
-    mutex_lock(&state_mutex);
-        LEDLOCK_SCHEDULE = false;
-    mutex_unlock(&state_mutex);
-    
-    // flush and destroy work queue
-    flush_workqueue(ledlock_wq);
-    destroy_workqueue(ledlock_wq);
-    
-    // unregister device
-    unregister_chrdev(LEDLOCK_MAJOR, "ledlock");
-    
-    // clear bits
-    ledlock_display_clear();
-    
-    printk("Module removed!\n");
+    spin_lock_irqsave(&dev->sim_lock, flags);
+        if (kfifo_is_full(&dev->sim_fifo)) {
+            kfifo_skip(&dev->sim_fifo);
+            ++dev->sim_dropped;
+        }
+        kfifo_put(&dev->sim_fifo, rec);
+    spin_unlock_irqrestore(&dev->sim_lock, flags);
 }
 
+static ssize_t ledlock_sim_read(struct file *fp, char __user *buffer,
+                                size_t count, loff_t *pos)
+{
+    struct ledlock_dev *dev = fp->private_data;
+    struct ledlock_sim_record recs[32];
+    unsigned int n;
+    unsigned long flags;
 
+    n = min_t(size_t, count / sizeof(recs[0]), ARRAY_SIZE(recs));
+    if (!n) return -EINVAL;
 
-module_init(ledlock_init);
-module_exit(ledlock_cleanup);
+    spin_lock_irqsave(&dev->sim_lock, flags);
+        n = kfifo_out(&dev->sim_fifo, recs, n);
+    spin_unlock_irqrestore(&dev->sim_lock, flags);
+
+    if (copy_to_user(buffer, recs, n * sizeof(recs[0]))) return -EFAULT;
+    return n * sizeof(recs[0]);
+}
 
+static const struct file_operations ledlock_sim_fops = {
+    .owner      = THIS_MODULE,
+    .open       = simple_open,
+    .read       = ledlock_sim_read,
+    .llseek     = noop_llseek,
+};
 
+static void ledlock_sim_exit(struct ledlock_dev *dev) {
+    kfifo_free(&dev->sim_fifo);
+}
 
+static void ledlock_sim_debugfs(struct ledlock_dev *dev) {
+    debugfs_create_file("sim", 0444, dev->debugfs, dev, &ledlock_sim_fops);
+    debugfs_create_u64("sim_dropped", 0444, dev->debugfs, &dev->sim_dropped);
+}
 
 
+static const struct ledlock_backend ledlock_backends[] = {
+    {
+        .name   = "port",
+        .init   = ledlock_port_init,
+        .exit   = ledlock_port_exit,
+        .write  = ledlock_port_write,
+    },
+    {
+        .name   = "parport",
+        .probe  = ledlock_parport_probe,
+        .remove = ledlock_parport_remove,
+        .init   = ledlock_parport_init,
+        .exit   = ledlock_parport_exit,
+        .write  = ledlock_parport_write,
+        .claim  = ledlock_parport_claim,
+        .yield  = ledlock_parport_yield,
+    },
+    {
+        .name   = "sim",
+        .init   = ledlock_sim_init,
+        .exit   = ledlock_sim_exit,
+        .write  = ledlock_sim_write,
+        .debugfs = ledlock_sim_debugfs,
+    },
+};
 
+// Reports where the timers run, as chosen at load time.
+static int ledlock_engine_show(struct seq_file *m, void *v) {
+    seq_printf(m, "context %s\n", ledlock_contexts[ledlock_wheel_context]);
+    if (ledlock_wheel_thread)
+        seq_printf(m, "cpus %*pbl\npolicy %s\n",
+                   cpumask_pr_args(ledlock_wheel_cpus),
+                   rt ? "fifo" : "normal");
+    seq_printf(m, "timers %s\nslack_us %u\n", slack_us ? "slack" : "hard",
+               slack_us);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ledlock_engine);
 
+// picks the backend named by the backend parameter and brings it up
+static int ledlock_backend_init(void) {
+    int result, i;
 
+    for (i = 0; i < ARRAY_SIZE(ledlock_backends); ++i) {
+        if (!strcmp(backend, ledlock_backends[i].name)) break;
+    }
+    if (i == ARRAY_SIZE(ledlock_backends)) {
+        printk("ERROR: Unknown backend \"%s\"\n", backend);
+        return -EINVAL;
+    }
+    ledlock_backend = &ledlock_backends[i];
+    if (ledlock_backend->probe) {
+        result = ledlock_backend->probe();
+        if (result) return result;
+    }
 
+    // only once the probe has worked, as a failed one leaves nothing to
+    //  remove the files and they would outlive the module
+    ledlock_debugfs = debugfs_create_dir("ledlock", NULL);
+    debugfs_create_u64("wakeups", 0444, ledlock_debugfs,
+                       &ledlock_wheel_wakeups);
+    debugfs_create_file("engine", 0444, ledlock_debugfs, NULL,
+                        &ledlock_engine_fops);
+    return 0;
+}
 
+static void ledlock_backend_exit(void) {
+    if (ledlock_backend->remove) ledlock_backend->remove();
+    debugfs_remove_recursive(ledlock_debugfs);
+}
 
+// Reports a lateness figure as the number of samples and the worst and mean
+//  lateness.
+static int ledlock_stat_show(struct seq_file *m, void *v) {
+    struct ledlock_stat *stat = m->private;
+    u64 samples = READ_ONCE(stat->samples);
 
+    seq_printf(m, "samples %llu\nmax_ns %llu\nmean_ns %llu\n", samples,
+               READ_ONCE(stat->max_ns),
+               samples ? div64_u64(READ_ONCE(stat->total_ns), samples) : 0);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ledlock_stat);
 
+// Reports a display's running counts, one "name value" pair per line. Time
+//  spent paused includes any pause still going on.
+static int ledlock_stats_show(struct seq_file *m, void *v) {
+    struct ledlock_dev *dev = m->private;
+    struct ledlock_counters *c = &dev->counters;
+    u64 now = ktime_get_ns(), paused, since;
+    unsigned int seq;
 
+    do {
+        seq    = read_seqbegin(&dev->counter_seq);
+        since  = READ_ONCE(c->since_ns);
+        paused = c->paused_ns;
+        if (ledlock_test(dev, LEDLOCK_PAUSED))
+            paused += now - max(dev->pause_nsmarker, since);
+    } while (read_seqretry(&dev->counter_seq, seq));
+
+    seq_printf(m, "frames %llu\nport_writes %llu\nport_suppressed %llu\n"
+               "port_busy %llu\nskipped_seconds %llu\nwraps %llu\n"
+               "deadline_misses %llu\nworst_overshoot_ns %llu\n"
+               "wakeups %llu\nsession_switches %llu\n",
+               READ_ONCE(c->frames), READ_ONCE(c->port_writes),
+               READ_ONCE(c->port_suppressed), READ_ONCE(c->port_busy),
+               READ_ONCE(c->skipped), READ_ONCE(c->wraps),
+               READ_ONCE(c->misses), READ_ONCE(c->overshoot_ns),
+               READ_ONCE(c->wakeups), READ_ONCE(c->switches));
+    seq_printf(m, "paused_ns %llu\nreads %lld\nwrites %lld\nioctls %lld\n"
+               "seq_retries %lld\nmutex_waits %lld\nsince_reset_ns %llu\n",
+               paused, atomic64_read(&c->reads), atomic64_read(&c->writes),
+               atomic64_read(&c->ioctls), atomic64_read(&c->seq_retries),
+               atomic64_read(&c->mutex_waits), now - since);
+    return 0;
+}
 
+static int ledlock_stats_open(struct inode *inode, struct file *fp) {
+    return single_open(fp, ledlock_stats_show, inode->i_private);
+}
 
+// Any write resets the counts, whatever is written.
+static ssize_t ledlock_stats_write(struct file *fp, const char __user *buffer,
+                                   size_t count, loff_t *pos)
+{
+    struct ledlock_dev *dev = ((struct seq_file *)fp->private_data)->private;
+    struct ledlock_counters *c = &dev->counters;
+    unsigned long flags;
+
+    // under the seqlock, so paused_ns and since_ns move together
+    write_seqlock_irqsave(&dev->counter_seq, flags);
+        WRITE_ONCE(c->frames, 0);
+        WRITE_ONCE(c->port_writes, 0);
+        WRITE_ONCE(c->port_suppressed, 0);
+        WRITE_ONCE(c->port_busy, 0);
+        WRITE_ONCE(c->skipped, 0);
+        WRITE_ONCE(c->wraps, 0);
+        WRITE_ONCE(c->misses, 0);
+        WRITE_ONCE(c->wakeups, 0);
+        WRITE_ONCE(c->overshoot_ns, 0);
+        WRITE_ONCE(c->switches, 0);
+        c->paused_ns = 0;
+        WRITE_ONCE(c->since_ns, ktime_get_ns());
+    write_sequnlock_irqrestore(&dev->counter_seq, flags);
+    atomic64_set(&c->reads, 0);
+    atomic64_set(&c->writes, 0);
+    atomic64_set(&c->ioctls, 0);
+    atomic64_set(&c->seq_retries, 0);
+    atomic64_set(&c->mutex_waits, 0);
+
+    return count;
+}
+
+static const struct file_operations ledlock_stats_fops = {
+    .owner      = THIS_MODULE,
+    .open       = ledlock_stats_open,
+    .read       = seq_read,
+    .write      = ledlock_stats_write,
+    .llseek     = seq_lseek,
+    .release    = single_release,
+};
+
+// Lists the timer sessions, one a line with the one on show starred: whose
+//  it is, priority, slice, cap, count and state.
+static int ledlock_sessions_show(struct seq_file *m, void *v) {
+    struct ledlock_dev *dev = m->private;
+    struct ledlock_session *ses;
+    unsigned long flags;
+    bool shown;
+    int state;
+
+    // sessions come and go under writers, so lock them out for the walk
+    read_seqlock_excl_irqsave(&dev->counter_seq, flags);
+        list_for_each_entry(ses, &dev->sessions, node) {
+            shown = ses == dev->on_show;
+            state = shown ? atomic_read(&dev->state) : ses->flags;
+            seq_printf(m, "%c %-6s priority %d slice_ms %u cap %llu "
+                       "count %llu%s%s%s\n", shown ? '*' : ' ',
+                       ses == &dev->shared ? "shared" : "own", ses->priority,
+                       ses->slice_ms ? ses->slice_ms : slice_ms,
+                       shown ? dev->count_cap : ses->count_cap,
+                       ledlock_session_count(dev, ses),
+                       (state & LEDLOCK_WRITTEN) ? " written" : "",
+                       (state & LEDLOCK_PAUSED)  ? " paused"  : "",
+                       (state & LEDLOCK_WRAP)    ? " wrap"    : "");
+        }
+    read_sequnlock_excl_irqrestore(&dev->counter_seq, flags);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ledlock_sessions);
+
+// Brings up the output of one display, with its own debugfs directory for
+//  the backend's files and its statistics.
+static int ledlock_backend_attach(struct ledlock_dev *dev) {
+    char name[16];
+    int result;
+
+    result = ledlock_backend->init(dev);
+    if (result) {
+        printk("ERROR: Cannot start backend \"%s\" for ledlock%d\n", backend,
+               dev->minor);
+        return result;
+    }
+
+    snprintf(name, sizeof(name), "ledlock%d", dev->minor);
+    dev->debugfs = debugfs_create_dir(name, ledlock_debugfs);
+    if (ledlock_backend->debugfs) ledlock_backend->debugfs(dev);
+
+    // display program cache statistics, next to the backend's own files
+    debugfs_create_u64("program_hits", 0444, dev->debugfs,
+                       &dev->program_hits);
+    debugfs_create_u64("program_builds", 0444, dev->debugfs,
+                       &dev->program_builds);
+    debugfs_create_u64("stream_underruns", 0444, dev->debugfs,
+                       &dev->stream_underruns);
+    debugfs_create_u64("laps_dropped", 0444, dev->debugfs,
+                       &dev->laps_dropped);
+    debugfs_create_file("drift", 0444, dev->debugfs, &dev->drift,
+                        &ledlock_stat_fops);
+    debugfs_create_file("latency", 0444, dev->debugfs, &dev->latency,
+                        &ledlock_stat_fops);
+    debugfs_create_file("stats", 0644, dev->debugfs, dev,
+                        &ledlock_stats_fops);
+    debugfs_create_file("sessions", 0444, dev->debugfs, dev,
+                        &ledlock_sessions_fops);
+    return 0;
+}
+
+static void ledlock_backend_detach(struct ledlock_dev *dev) {
+    debugfs_remove_recursive(dev->debugfs);
+    ledlock_backend->exit(dev);
+}
+
+
+
+//=============================================================================
+//                              Shared Timer
+//=============================================================================
+
+// Every display's timed activities go through one hrtimer rather than one
+//  per display each. Pending ledlock_timers sit on a list kept in expiry
+//  order, and the hrtimer is armed for the head of it. Callbacks run from the
+//  hrtimer callback with the list unlocked, one at a time.
+
+static void ledlock_timer_setup(struct ledlock_timer *timer,
+                    enum hrtimer_restart (*fn)(struct ledlock_timer *timer))
+{
+    INIT_LIST_HEAD(&timer->node);
+    timer->expires    = 0;
+    timer->fn         = fn;
+    timer->restarting = false;
+}
+
+// queues a timer in expiry order, caller holds ledlock_wheel_lock
+static void ledlock_wheel_add(struct ledlock_timer *timer) {
+    struct ledlock_timer *pos;
+
+    list_for_each_entry(pos, &ledlock_wheel_list, node) {
+        if (ktime_before(timer->expires, pos->expires)) break;
+    }
+    list_add_tail(&timer->node, &pos->node);
+}
+
+// arms the hrtimer for the soonest pending timer, caller holds the lock
+static void ledlock_wheel_arm(void) {
+    struct ledlock_timer *first;
+
+    first = list_first_entry_or_null(&ledlock_wheel_list,
+                                     struct ledlock_timer, node);
+    if (first)
+        hrtimer_start_range_ns(&ledlock_wheel, first->expires,
+                               (u64)slack_us * NSEC_PER_USEC,
+                               ledlock_wheel_mode);
+}
+
+// (Re)starts a timer for an absolute CLOCK_MONOTONIC time. Starting a timer
+//  from elsewhere while its callback runs takes effect once the callback
+//  returns, overriding whatever it chose, so the callback can always move
+//  its own expires freely.
+static void ledlock_timer_start(struct ledlock_timer *timer, ktime_t expires) {
+    unsigned long flags;
+
+    spin_lock_irqsave(&ledlock_wheel_lock, flags);
+        if (ledlock_wheel_running == timer) {
+            timer->restart    = expires;
+            timer->restarting = true;
+            spin_unlock_irqrestore(&ledlock_wheel_lock, flags);
+            return;
+        }
+        list_del_init(&timer->node);
+        timer->expires = expires;
+        ledlock_wheel_add(timer);
+
+        // only a new soonest expiry moves the hrtimer
+        if (list_first_entry(&ledlock_wheel_list, struct ledlock_timer,
+                             node) == timer)
+            ledlock_wheel_arm();
+    spin_unlock_irqrestore(&ledlock_wheel_lock, flags);
+}
+
+// ledlock_core_forward() for ktimes
+static ktime_t ledlock_forward(ktime_t expires, ktime_t now, u64 interval) {
+    return ns_to_ktime(ledlock_core_forward(ktime_to_ns(expires),
+                                            ktime_to_ns(now), interval));
+}
+
+// Stops a timer, waiting for its callback to finish if it is running, like
+//  hrtimer_cancel(). The wait sleeps rather than spins, as the callback may
+//  be in ksoftirqd or the engine thread on this very CPU, so it may only be
+//  called from process context, or from another timer's callback, which
+//  the wheel never runs alongside this one's.
+static void ledlock_timer_cancel(struct ledlock_timer *timer) {
+    unsigned long flags;
+    bool first;
+
+    spin_lock_irqsave(&ledlock_wheel_lock, flags);
+        while (ledlock_wheel_running == timer) {
+            spin_unlock_irqrestore(&ledlock_wheel_lock, flags);
+            wait_event(ledlock_wheel_idle,
+                       READ_ONCE(ledlock_wheel_running) != timer);
+            spin_lock_irqsave(&ledlock_wheel_lock, flags);
+        }
+        first = list_first_entry_or_null(&ledlock_wheel_list,
+                                         struct ledlock_timer, node) == timer;
+        list_del_init(&timer->node);
+
+        // don't leave the hrtimer to fire for nothing, the wheel only
+        //  wakes while there is something to run
+        if (first) {
+            if (list_empty(&ledlock_wheel_list))
+                hrtimer_try_to_cancel(&ledlock_wheel);
+            else
+                ledlock_wheel_arm();
+        }
+    spin_unlock_irqrestore(&ledlock_wheel_lock, flags);
+}
+
+// Stops a timer without waiting, like hrtimer_try_to_cancel(), so it may be
+//  called under other locks or from the timer's own callback. A callback
+//  that is running carries on, but any start meanwhile is dropped.
+static void ledlock_timer_try_to_cancel(struct ledlock_timer *timer) {
+    unsigned long flags;
+    bool first;
+
+    spin_lock_irqsave(&ledlock_wheel_lock, flags);
+        timer->restarting = false;
+        first = list_first_entry_or_null(&ledlock_wheel_list,
+                                         struct ledlock_timer, node) == timer;
+        list_del_init(&timer->node);
+        if (first) {
+            if (list_empty(&ledlock_wheel_list))
+                hrtimer_try_to_cancel(&ledlock_wheel);
+            else
+                ledlock_wheel_arm();
+        }
+    spin_unlock_irqrestore(&ledlock_wheel_lock, flags);
+}
+
+// Runs every timer that is due, re-queueing those that ask to restart or
+//  were started again meanwhile, then re-arms for whatever is next.
+static void ledlock_wheel_run(void) {
+    struct ledlock_timer *timer;
+    enum hrtimer_restart restart;
+    unsigned long flags;
+    ktime_t now = ktime_get();
+
+    spin_lock_irqsave(&ledlock_wheel_lock, flags);
+        while ((timer = list_first_entry_or_null(&ledlock_wheel_list,
+                                                 struct ledlock_timer,
+                                                 node))) {
+            if (ktime_after(timer->expires, now)) break;
+            list_del_init(&timer->node);
+            ledlock_wheel_running = timer;
+            spin_unlock_irqrestore(&ledlock_wheel_lock, flags);
+
+            restart = timer->fn(timer);
+
+            spin_lock_irqsave(&ledlock_wheel_lock, flags);
+            ledlock_wheel_running = NULL;
+            if (wq_has_sleeper(&ledlock_wheel_idle))
+                wake_up(&ledlock_wheel_idle);
+            if (timer->restarting) {
+                timer->restarting = false;
+                timer->expires    = timer->restart;
+                ledlock_wheel_add(timer);
+            }
+            else if (restart == HRTIMER_RESTART) {
+                ledlock_wheel_add(timer);
+            }
+        }
+        ledlock_wheel_arm();
+    spin_unlock_irqrestore(&ledlock_wheel_lock, flags);
+}
+
+// The hrtimer callback, which runs the timers itself or hands them to the
+//  engine thread.
+static enum hrtimer_restart ledlock_wheel_fn(struct hrtimer *hrtimer) {
+    ++ledlock_wheel_wakeups;
+    if (ledlock_wheel_thread) {
+        atomic_set(&ledlock_wheel_kicked, 1);
+        wake_up_process(ledlock_wheel_thread);
+    }
+    else {
+        ledlock_wheel_run();
+    }
+    return HRTIMER_NORESTART;
+}
+
+// The engine thread, which sleeps until the hrtimer has timers for it.
+static int ledlock_wheel_thread_fn(void *unused) {
+    for (;;) {
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (kthread_should_stop()) break;
+        if (!atomic_xchg(&ledlock_wheel_kicked, 0)) {
+            schedule();
+            continue;
+        }
+        __set_current_state(TASK_RUNNING);
+        ledlock_wheel_run();
+    }
+    __set_current_state(TASK_RUNNING);
+    return 0;
+}
+
+// Sets up the shared timer to run its timers from the context the engine
+//  parameter asks for. The thread is kept to the cpus parameter, so the
+//  displays can be left to housekeeping CPUs. The hrtimer itself is not
+//  pinned, so the kernel already keeps it off nohz_full CPUs.
+static int ledlock_wheel_init(void) {
+    int i, result;
+
+    for (i = 0; i < ARRAY_SIZE(ledlock_contexts); ++i) {
+        if (!strcmp(engine, ledlock_contexts[i])) break;
+    }
+    if (i == ARRAY_SIZE(ledlock_contexts)) {
+        printk("ERROR: Unknown engine \"%s\"\n", engine);
+        return -EINVAL;
+    }
+    ledlock_wheel_context = i;
+    ledlock_wheel_mode = i == LEDLOCK_CTX_SOFTIRQ ? HRTIMER_MODE_ABS_SOFT
+                                                  : HRTIMER_MODE_ABS;
+    hrtimer_setup(&ledlock_wheel, ledlock_wheel_fn, CLOCK_MONOTONIC,
+                  ledlock_wheel_mode);
+    printk("ledlock timers run from %s, %s\n", engine,
+           slack_us ? "with slack" : "hard");
+
+    if (ledlock_wheel_context != LEDLOCK_CTX_THREAD) {
+        if (*cpus || rt)
+            printk("ledlock: cpus and rt only apply to engine=thread\n");
+        return 0;
+    }
+
+    if (!zalloc_cpumask_var(&ledlock_wheel_cpus, GFP_KERNEL)) return -ENOMEM;
+    if (!*cpus) {
+        cpumask_copy(ledlock_wheel_cpus, cpu_possible_mask);
+    }
+    else if (cpulist_parse(cpus, ledlock_wheel_cpus) ||
+             !cpumask_intersects(ledlock_wheel_cpus, cpu_online_mask)) {
+        printk("ERROR: No online CPUs in \"%s\"\n", cpus);
+        result = -EINVAL;
+        goto fail;
+    }
+
+    ledlock_wheel_thread = kthread_create(ledlock_wheel_thread_fn, NULL,
+                                          "ledlock");
+    if (IS_ERR(ledlock_wheel_thread)) {
+        result = PTR_ERR(ledlock_wheel_thread);
+        ledlock_wheel_thread = NULL;
+        goto fail;
+    }
+    set_cpus_allowed_ptr(ledlock_wheel_thread, ledlock_wheel_cpus);
+    if (rt) sched_set_fifo(ledlock_wheel_thread);
+    wake_up_process(ledlock_wheel_thread);
+    return 0;
+
+fail:
+    free_cpumask_var(ledlock_wheel_cpus);
+    return result;
+}
+
+// Stops the shared timer, once no display has a timer pending.
+static void ledlock_wheel_exit(void) {
+    hrtimer_cancel(&ledlock_wheel);
+    if (ledlock_wheel_thread) {
+        kthread_stop(ledlock_wheel_thread);
+        ledlock_wheel_thread = NULL;
+        free_cpumask_var(ledlock_wheel_cpus);
+    }
+}
+
+
+
+//=============================================================================
+//                                  Helpers
+//=============================================================================
+
+
+// Sends a byte to the port, unless the shadow copy says it already holds
+//  it, as a legacy port write costs about a microsecond. With refresh_ms set
+//  an unchanged byte is still rewritten once it has stood that long, for
+//  hardware that may lose it. Only the display's own writes refresh it, a
+//  parked display is left alone.
+static void ledlock_port_put(struct ledlock_dev *dev, unsigned char val) {
+    unsigned int refresh = READ_ONCE(refresh_ms);
+    u64 now = 0;
+
+    if (ledlock_backend->claim && !ledlock_backend->claim(dev)) {
+        ++dev->counters.port_busy;
+        return;
+    }
+
+    if (refresh) now = ktime_get_ns();
+    if (dev->port_shadow == val &&
+        (!refresh ||
+         now - dev->port_write_ns < (u64)refresh * NSEC_PER_MSEC)) {
+        ++dev->counters.port_suppressed;
+        return;
+    }
+
+    ledlock_backend->write(dev, val);
+    dev->port_shadow   = val;
+    dev->port_write_ns = now;
+    ++dev->counters.port_writes;
+}
+
+// Lets other drivers sharing the port have it until the display next writes,
+//  between digit sequences and while parked.
+static void ledlock_port_yield(struct ledlock_dev *dev) {
+    if (ledlock_backend->yield) ledlock_backend->yield(dev);
+}
+
+// writes 8 bits to device
+//  does not reorder bits, just writes as-is
+void ledlock_display_digit(struct ledlock_dev *dev, char val) {
+    dev->last_digit = val;
+    ledlock_port_put(dev, val);
+    ledlock_status_publish(dev);
+}
+
+// same as above, but clears display
+void ledlock_display_clear(struct ledlock_dev *dev) {
+    ledlock_port_put(dev, 0);
+}
+
+// Nanoseconds from the last write to now, less the time spent paused. While
+//  paused this is frozen at the moment the pause began. Callers must be
+//  inside a counter_seq section so the markers and pause flag agree.
+static u64 ledlock_elapsed_ns(struct ledlock_dev *dev, u64 now) {
+    int state = atomic_read(&dev->state);
+
+    if (!(state & LEDLOCK_WRITTEN)) return 0;
+    return ledlock_core_elapsed(now, dev->write_ns, dev->pause_ns,
+                                dev->pause_nsmarker, state & LEDLOCK_PAUSED);
+}
+
+// The first second boundary of the count after now. Boundaries fall a whole
+//  number of unpaused seconds after the write() instant, so the count keeps
+//  the phase of the write rather than of jiffies. Same locking rules as
+//  ledlock_elapsed_ns(), and only meaningful while unpaused.
+static ktime_t ledlock_next_second(struct ledlock_dev *dev, ktime_t now) {
+    return ledlock_forward(ns_to_ktime(dev->write_ns + dev->pause_ns), now,
+                           NSEC_PER_SEC);
+}
+
+// Works out the counter from the elapsed time, wrapped or clamped against
+//  the cap. Same locking rules as ledlock_elapsed_ns().
+static u64 ledlock_current_count(struct ledlock_dev *dev) {
+    return ledlock_core_count(ledlock_elapsed_ns(dev, ktime_get_ns()),
+                              dev->count_cap, ledlock_test(dev, LEDLOCK_WRAP));
+}
+
+// Compiles a value into display frames with ledlock_core_compile(), first
+//  bringing the packed digits of the value up to date.
+static void ledlock_compile_program(struct ledlock_dev *dev,
+                                    const struct ledlock_program_key *key)
+{
+    // bring the packed digits up to date, usually just adding one
+    dev->bcd = ledlock_bcd_advance(dev->bcd, dev->bcd_value, key->value);
+    dev->bcd_value = key->value;
+
+    dev->engine.program_len = ledlock_core_compile(dev->engine.program,
+                                                   dev->bcd, key->wrap,
+                                                   key->time_display,
+                                                   key->time_blank_digit,
+                                                   key->time_blank_value);
+    if (dev->engine.program_len != 2 * ledlock_bcd_len(dev->bcd))
+        pr_err_ratelimited("ERROR: Bad digit buffer on ledlock%d\n",
+                           dev->minor);
+    dev->program_key = *key;
+}
+
+// Loads the display program for the current count, only compiling a new one
+//  if the count, wrap or a timing has changed since the last. Called by the
+//  display engine at the start of each digit sequence, the value and timings
+//  being read together so a configuration change is never seen half-applied.
+void ledlock_display_value(struct ledlock_dev *dev) {
+    struct ledlock_program_key key;
+    unsigned int seq;
+
+    do {
+        seq = read_seqbegin(&dev->counter_seq);
+        key.value            = ledlock_current_count(dev);
+        key.wrap             = ledlock_test(dev, LEDLOCK_WRAP);
+        key.time_display     = dev->time_display;
+        key.time_blank_digit = dev->time_blank_digit;
+        key.time_blank_value = dev->time_blank_value;
+    } while (ledlock_read_retry(dev, seq));
+
+    // the count only goes down by wrapping, and any gap going up is seconds
+    //  that were never shown
+    if (dev->engine.shown) {
+        if (key.value < dev->count)
+            ++dev->counters.wraps;
+        else if (key.value > dev->count + 1)
+            dev->counters.skipped += key.value - dev->count - 1;
+    }
+    dev->count = key.value;
+    pr_debug("\t\tDisplaying: %llu\n", key.value);
+
+    if (dev->engine.program_len &&
+        !memcmp(&key, &dev->program_key, sizeof(key))) {
+        ++dev->program_hits;
+        return;
+    }
+    ledlock_compile_program(dev, &key);
+    ++dev->program_builds;
+}
+
+
+// the engine has something to do: written, unpaused, displaying and not
+//  handed the port over to stream mode
+static bool ledlock_runnable(struct ledlock_dev *dev) {
+    int state = atomic_read(&dev->state);
+
+    return (state & (LEDLOCK_SCHEDULE | LEDLOCK_WRITTEN | LEDLOCK_DISPLAY |
+                     LEDLOCK_PAUSED | LEDLOCK_STREAM)) ==
+           (LEDLOCK_SCHEDULE | LEDLOCK_WRITTEN | LEDLOCK_DISPLAY);
+}
+
+// Restarts a parked engine so it re-reads the flags right away. Does nothing
+//  if the engine is already running, it will see the new flags on its own,
+//  or if there is nothing for it to do.
+static void ledlock_engine_kick(struct ledlock_dev *dev) {
+    if (!ledlock_runnable(dev)) return;
+    if (!ledlock_test_and_set(dev, LEDLOCK_RUNNING)) {
+        ledlock_clear(dev, LEDLOCK_POKED);      // a fresh start sees it all
+        WRITE_ONCE(dev->due, 0);
+        ledlock_timer_start(&dev->timer, ktime_get());
+    }
+}
+
+// Posts a control change to a running engine, cutting its current frame
+//  short so the change shows within microseconds rather than at the next gap
+//  between digits. A parked engine is left alone, whatever kick wakes it
+//  will see the change anyway.
+static void ledlock_engine_post(struct ledlock_dev *dev) {
+    WRITE_ONCE(dev->cmd_ns, ktime_get_ns());
+    ledlock_set(dev, LEDLOCK_POKED);
+    if (ledlock_test(dev, LEDLOCK_RUNNING))
+        ledlock_timer_start(&dev->timer, ktime_get());
+}
+
+// Starts the engine over on a fresh digit sequence, so a new write is shown
+//  at once and seconds are counted from it rather than from the old phase.
+//  The restart is posted to the engine timer, which is woken even when it
+//  has nothing to show so it can blank, and does the rest itself, so
+//  writers and the slice timer never touch the engine's state.
+static void ledlock_engine_restart(struct ledlock_dev *dev) {
+    if (ledlock_test(dev, LEDLOCK_STREAM)) return;
+
+    ledlock_set(dev, LEDLOCK_RESTART);
+    if (!ledlock_test_and_set(dev, LEDLOCK_RUNNING)) {
+        ledlock_clear(dev, LEDLOCK_POKED);      // a fresh start sees it all
+        WRITE_ONCE(dev->due, 0);
+    }
+    ledlock_timer_start(&dev->timer, ktime_get());
+}
+
+// What the display engine does to the port and its stats, ctx being the
+//  ledlock_dev. Each runs from the engine timer, see ledlock_core_step().
+
+// Latches a frame's segments onto the port, 0 blanking it.
+static void ledlock_engine_latch(void *ctx, char segments) {
+    if (segments) ledlock_display_digit(ctx, segments);
+    else          ledlock_display_clear(ctx);
+}
+
+// Counts and traces what the engine just put on the port, for a step that
+//  was due when its timer expired.
+static void ledlock_engine_frame(void *ctx, char segments,
+                                 unsigned int dwell_ms)
+{
+    struct ledlock_dev *dev = ctx;
+
+    ++dev->counters.frames;
+    if (trace_ledlock_frame_enabled())
+        trace_ledlock_frame(dev->minor, segments, dwell_ms * USEC_PER_MSEC,
+                            ktime_to_ns(dev->timer.expires), ktime_get_ns());
+}
+
+// ... and a pause it froze on or moved on from.
+static void ledlock_engine_pause(void *ctx, bool paused) {
+    struct ledlock_dev *dev = ctx;
+
+    if (trace_ledlock_pause_enabled())
+        trace_ledlock_pause(dev->minor, paused,
+                            ktime_to_ns(dev->timer.expires), ktime_get_ns());
+}
+
+static void ledlock_engine_yield(void *ctx) {
+    ledlock_port_yield(ctx);
+}
+
+static void ledlock_engine_load(void *ctx) {
+    ledlock_display_value(ctx);
+}
+
+// Parks the engine, so no timer is armed until ledlock_engine_kick(). If a
+//  kick raced with us and nobody else restarted the engine, carry on instead.
+static unsigned int ledlock_engine_park(void *ctx) {
+    struct ledlock_dev *dev = ctx;
+
+    ledlock_clear(dev, LEDLOCK_RUNNING);
+    if (ledlock_runnable(dev) && !ledlock_test_and_set(dev, LEDLOCK_RUNNING))
+        return 0;
+    return LEDLOCK_IDLE;
+}
+
+static const struct ledlock_core_ops ledlock_engine_ops = {
+    .latch  = ledlock_engine_latch,
+    .frame  = ledlock_engine_frame,
+    .pause  = ledlock_engine_pause,
+    .yield  = ledlock_engine_yield,
+    .load   = ledlock_engine_load,
+    .park   = ledlock_engine_park,
+};
+
+// Steps the display engine over the device's flags, see ledlock_core_step().
+static unsigned int ledlock_display_step(struct ledlock_dev *dev) {
+    int state = atomic_read(&dev->state);
+
+    return ledlock_core_step(&dev->engine, &ledlock_engine_ops, dev,
+                             state & LEDLOCK_WRITTEN, state & LEDLOCK_PAUSED,
+                             state & LEDLOCK_DISPLAY);
+}
+
+// Acts on a control command that cut the current frame or wait short, see
+//  ledlock_core_preempt(). Wrap changing under the program starts the digit
+//  sequence over.
+static unsigned int ledlock_preempt(struct ledlock_dev *dev) {
+    int state = atomic_read(&dev->state);
+
+    return ledlock_core_preempt(&dev->engine, &ledlock_engine_ops, dev,
+                                state & LEDLOCK_PAUSED,
+                                state & LEDLOCK_DISPLAY,
+                                !!(state & LEDLOCK_WRAP) !=
+                                dev->program_key.wrap);
+}
+
+// Adds a sample to a lateness figure.
+static void ledlock_stat_add(struct ledlock_stat *stat, u64 late) {
+    ++stat->samples;
+    stat->total_ns += late;
+    stat->max_ns    = max(stat->max_ns, late);
+}
+
+// Timer callback driving the display engine. Steps the state machine until a
+//  delay is needed, then re-arms itself for that long, unless it parked.
+//  Frames are timed from when the previous one was due and seconds are
+//  absolute deadlines, so timer latency never accumulates into drift.
+static enum hrtimer_restart ledlock_timer_fn(struct ledlock_timer *timer) {
+    struct ledlock_dev *dev = container_of(timer, struct ledlock_dev, timer);
+    ktime_t now = ktime_get();
+    unsigned int delay = 0, seq;
+    bool acted = false;
+    u64 late;
+
+    ++dev->counters.wakeups;
+
+    // a post that raced with a switch to stream mode, which kicks the
+    //  engine afresh on the way out
+    if (ledlock_test(dev, LEDLOCK_STREAM)) {
+        ledlock_clear(dev, LEDLOCK_RUNNING);
+        return HRTIMER_NORESTART;
+    }
+    if (!ledlock_test(dev, LEDLOCK_SCHEDULE)) return HRTIMER_NORESTART;
+
+    // or with parking, unless it was a restart, which must still be seen to
+    //  and is unless a kick got in first and has the timer going again
+    if (!ledlock_test(dev, LEDLOCK_RUNNING) &&
+        (!ledlock_test(dev, LEDLOCK_RESTART) ||
+         ledlock_test_and_set(dev, LEDLOCK_RUNNING)))
+        return HRTIMER_NORESTART;
+
+    if (ktime_after(now, timer->expires)) {
+        late = ktime_to_ns(ktime_sub(now, timer->expires));
+        if (late > LEDLOCK_MISS_NS) ++dev->counters.misses;
+        dev->counters.overshoot_ns = max(dev->counters.overshoot_ns, late);
+    }
+
+    // a kick or a command rather than a boundary leaves expires elsewhere
+    if (timer->expires == dev->second_due)
+        ledlock_stat_add(&dev->drift, ktime_to_ns(ktime_sub(now,
+                                                            timer->expires)));
+
+    // a restart posted by a write or a session switch. A parked pause
+    //  resumes into the fresh sequence, and a count that won't be shown is
+    //  blanked rather than leave the last one's digit up, then parks below.
+    //  Nothing of the new count has been shown, so a pause re-latches blank.
+    if (ledlock_test_and_clear(dev, LEDLOCK_RESTART)) {
+        ledlock_clear(dev, LEDLOCK_POKED);
+        if (dev->engine.phase == LEDLOCK_PHASE_PAUSED)
+            dev->engine.resume_phase = LEDLOCK_PHASE_WAIT;
+        else
+            dev->engine.phase = LEDLOCK_PHASE_WAIT;
+        dev->engine.shown      = false;
+        dev->engine.last_digit = 0;
+        dev->last_digit        = 0;
+        ledlock_status_publish(dev);
+        if (!ledlock_runnable(dev)) {
+            ledlock_display_clear(dev);
+            ledlock_port_yield(dev);
+        }
+    }
+    else if (ledlock_test_and_clear(dev, LEDLOCK_POKED)) {
+        delay = ledlock_preempt(dev);
+        if (delay != LEDLOCK_RESUME) {
+            acted = true;
+        }
+        else if (ktime_after(dev->due, now)) {
+            timer->expires = dev->due;  // see out the frame that was cut
+            return HRTIMER_RESTART;
+        }
+        else {
+            delay = 0;
+        }
+    }
+    else if (ktime_after(dev->due, now)) {
+        // woken early for a command that an earlier step already saw to
+        timer->expires = dev->due;
+        return HRTIMER_RESTART;
+    }
+
+    while (!delay) delay = ledlock_display_step(dev);
+    if (acted)
+        ledlock_stat_add(&dev->latency,
+                         ktime_get_ns() - READ_ONCE(dev->cmd_ns));
+    if (delay == LEDLOCK_IDLE) return HRTIMER_NORESTART;
+
+    if (delay == LEDLOCK_SECOND) {
+        do {
+            seq = read_seqbegin(&dev->counter_seq);
+            timer->expires = ledlock_next_second(dev, ktime_get());
+        } while (ledlock_read_retry(dev, seq));
+        dev->second_due = timer->expires;
+    }
+    else {
+        timer->expires = ktime_add_ms(timer->expires, delay);
+    }
+    dev->due = timer->expires;
+    return HRTIMER_RESTART;
+}
+
+// bumps an event sequence number and wakes any pollers
+static void ledlock_notify(struct ledlock_dev *dev, atomic_t *events) {
+    atomic_inc(events);
+    wake_up_interruptible(&dev->waitq);
+}
+
+// When the count next changes, or KTIME_MAX if it won't: not yet written,
+//  paused, or stopped at the cap with wrap off. Callers must be inside a
+//  counter_seq section.
+static ktime_t ledlock_tick_deadline(struct ledlock_dev *dev, ktime_t now) {
+    int state = atomic_read(&dev->state);
+    u64 secs = div_u64(ledlock_elapsed_ns(dev, ktime_to_ns(now)),
+                       NSEC_PER_SEC);
+
+    if (!(state & LEDLOCK_WRITTEN) || (state & LEDLOCK_PAUSED))
+        return KTIME_MAX;
+    if (!(state & LEDLOCK_WRAP) && secs >= dev->count_cap)
+        return KTIME_MAX;
+
+    return ledlock_next_second(dev, now);
+}
+
+// the tick timer should keep going: the count moves and somebody waits on it
+static bool ledlock_tick_wanted(struct ledlock_dev *dev, ktime_t deadline) {
+    return deadline != KTIME_MAX && ledlock_test(dev, LEDLOCK_SCHEDULE) &&
+           wq_has_sleeper(&dev->waitq);
+}
+
+// Tick timer callback, fired whenever the count changes while somebody is
+//  polling. Raises a cap event if the count hit the cap or wrapped since the
+//  last tick. Seconds are compared rather than counts, so a cap of 1 still
+//  ticks.
+static enum hrtimer_restart ledlock_tick_fn(struct ledlock_timer *timer) {
+    struct ledlock_dev *dev = container_of(timer, struct ledlock_dev,
+                                           tick_timer);
+    u64 secs, last, cap;
+    unsigned long flags;
+    bool wrap = ledlock_test(dev, LEDLOCK_WRAP);
+    ktime_t now = ktime_get(), deadline;
+
+    ++dev->counters.wakeups;
+    write_seqlock_irqsave(&dev->counter_seq, flags);
+        secs     = div_u64(ledlock_elapsed_ns(dev, ktime_to_ns(now)),
+                           NSEC_PER_SEC);
+        last     = dev->tick_seconds;
+        cap      = dev->count_cap;
+        deadline = ledlock_tick_deadline(dev, now);
+        dev->tick_seconds = secs;
+    write_sequnlock_irqrestore(&dev->counter_seq, flags);
+
+    if (secs != last) {
+        trace_ledlock_tick(dev->minor, secs, ktime_to_ns(timer->expires),
+                           ktime_to_ns(now));
+        if (cap && (wrap ? div64_u64(secs, cap) != div64_u64(last, cap)
+                         : last < cap && secs >= cap))
+            ledlock_notify(dev, &dev->cap_events);
+        ledlock_notify(dev, &dev->ticks);
+    }
+
+    // keep ticking only while wanted, re-checking after standing down in
+    //  case a poller turned up in between
+    if (!ledlock_tick_wanted(dev, deadline)) {
+        ledlock_clear(dev, LEDLOCK_TICKING);
+        if (!ledlock_tick_wanted(dev, deadline) ||
+            ledlock_test_and_set(dev, LEDLOCK_TICKING))
+            return HRTIMER_NORESTART;
+    }
+
+    timer->expires = deadline;
+    return HRTIMER_RESTART;
+}
+
+// Arms the tick timer for the next count change, unless it is already armed,
+//  the count is not moving or nobody is waiting.
+static void ledlock_tick_kick(struct ledlock_dev *dev) {
+    ktime_t deadline;
+    unsigned int seq;
+
+    do {
+        seq      = read_seqbegin(&dev->counter_seq);
+        deadline = ledlock_tick_deadline(dev, ktime_get());
+    } while (ledlock_read_retry(dev, seq));
+
+    if (!ledlock_tick_wanted(dev, deadline)) return;
+    if (!ledlock_test_and_set(dev, LEDLOCK_TICKING))
+        ledlock_timer_start(&dev->tick_timer, deadline);
+}
+
+// Re-phases the tick timer after the markers moved under it.
+static void ledlock_tick_restart(struct ledlock_dev *dev) {
+    ledlock_timer_cancel(&dev->tick_timer);
+    ledlock_clear(dev, LEDLOCK_TICKING);
+    ledlock_tick_kick(dev);
+}
+
+
+
+//=============================================================================
+//                                  IOCTL
+//=============================================================================
+
+// Pauses or unpauses the count, marking the time and adding each pause to
+//  the total since the write. Returns whether the pause state actually
+//  changed. Called inside a counter_seq write section.
+static bool ledlock_pause_locked(struct ledlock_dev *dev, bool pause) {
+    u64 now;
+
+    if (pause) {
+        if (ledlock_test_and_set(dev, LEDLOCK_PAUSED)) return false;
+        ledlock_core_pause(ktime_get_ns(), &dev->pause_nsmarker);
+        return true;
+    }
+
+    if (!ledlock_test_and_clear(dev, LEDLOCK_PAUSED)) return false;
+    now = ktime_get_ns();
+    ledlock_core_resume(now, &dev->pause_ns, dev->pause_nsmarker);
+    dev->counters.paused_ns += now - max(dev->pause_nsmarker,
+                                         dev->counters.since_ns);
+    return true;
+}
+
+// Sets or clears a flag according to a bit of a userspace flags word.
+static void ledlock_assign(struct ledlock_dev *dev, int flag, bool on) {
+    if (on) ledlock_set(dev, flag);
+    else    ledlock_clear(dev, flag);
+}
+
+// ledlock_pause_locked() for a timer session, which is the device's count
+//  while on show. Returns whether the display's pause state changed.
+static bool ledlock_session_pause_locked(struct ledlock_dev *dev,
+                                         struct ledlock_session *ses,
+                                         bool pause)
+{
+    if (ses == dev->on_show) return ledlock_pause_locked(dev, pause);
+
+    if (pause && !(ses->flags & LEDLOCK_PAUSED)) {
+        ses->flags |= LEDLOCK_PAUSED;
+        ledlock_core_pause(ktime_get_ns(), &ses->pause_nsmarker);
+    }
+    else if (!pause && (ses->flags & LEDLOCK_PAUSED)) {
+        ses->flags &= ~LEDLOCK_PAUSED;
+        ledlock_core_resume(ktime_get_ns(), &ses->pause_ns,
+                            ses->pause_nsmarker);
+    }
+    return false;
+}
+
+// Turns a timer session's wrap on or off, returning whether it is on show.
+//  Called inside a counter_seq write section.
+static bool ledlock_session_wrap_locked(struct ledlock_dev *dev,
+                                        struct ledlock_session *ses,
+                                        bool wrap)
+{
+    if (ses == dev->on_show) {
+        ledlock_assign(dev, LEDLOCK_WRAP, wrap);
+        return true;
+    }
+    if (wrap) ses->flags |= LEDLOCK_WRAP;
+    else      ses->flags &= ~LEDLOCK_WRAP;
+    return false;
+}
+
+// Applies every parameter selected by cfg->mask in one counter_seq write
+//  section, so neither readers nor the display engine ever see a mix of old
+//  and new settings. Pause and wrap go to the caller's timer session.
+static int ledlock_set_config(struct ledlock_dev *dev,
+                              struct ledlock_session *ses,
+                              const struct ledlock_config *cfg)
+{
+    bool pause = cfg->flags & LEDLOCK_STATUS_PAUSED;
+    bool changed = false;
+    unsigned long flags;
+
+    if (cfg->mask & ~LEDLOCK_CFG_ALL) return -EINVAL;
+
+    // past the longest timing a frame could be taken for an engine sentinel
+    if (((cfg->mask & LEDLOCK_CFG_TIME_DISPLAY) &&
+         cfg->time_display > LEDLOCK_MAX_TIME_MS) ||
+        ((cfg->mask & LEDLOCK_CFG_BLANK_DIGIT) &&
+         cfg->time_blank_digit > LEDLOCK_MAX_TIME_MS) ||
+        ((cfg->mask & LEDLOCK_CFG_BLANK_VALUE) &&
+         cfg->time_blank_value > LEDLOCK_MAX_TIME_MS))
+        return -EINVAL;
+
+    write_seqlock_irqsave(&dev->counter_seq, flags);
+        if (cfg->mask & LEDLOCK_CFG_PAUSE)
+            changed = ledlock_session_pause_locked(dev, ses, pause);
+        if (cfg->mask & LEDLOCK_CFG_WRAP)
+            ledlock_session_wrap_locked(dev, ses,
+                                        cfg->flags & LEDLOCK_STATUS_WRAP);
+        if (cfg->mask & LEDLOCK_CFG_DISPLAY)
+            ledlock_assign(dev, LEDLOCK_DISPLAY,
+                           cfg->flags & LEDLOCK_STATUS_DISPLAY);
+        if (cfg->mask & LEDLOCK_CFG_TIME_DISPLAY)
+            dev->time_display = cfg->time_display;
+        if (cfg->mask & LEDLOCK_CFG_BLANK_DIGIT)
+            dev->time_blank_digit = cfg->time_blank_digit;
+        if (cfg->mask & LEDLOCK_CFG_BLANK_VALUE)
+            dev->time_blank_value = cfg->time_blank_value;
+    write_sequnlock_irqrestore(&dev->counter_seq, flags);
+
+    if (changed) {
+        ledlock_notify(dev, &dev->pause_events);
+        ledlock_tick_restart(dev);
+    }
+    if (cfg->mask & LEDLOCK_CFG_PAUSE) ledlock_schedule(dev, false);
+    if (cfg->mask & (LEDLOCK_CFG_PAUSE | LEDLOCK_CFG_WRAP |
+                     LEDLOCK_CFG_DISPLAY))
+        ledlock_engine_post(dev);
+    ledlock_engine_kick(dev);
+    ledlock_tick_kick(dev);
+    return 0;
+}
+
+// Reads every parameter back as one consistent set, with pause and wrap
+//  from the given timer session, or from the display if NULL.
+static void ledlock_get_config(struct ledlock_dev *dev,
+                               struct ledlock_session *ses,
+                               struct ledlock_config *cfg)
+{
+    unsigned int seq;
+    int state;
+
+    memset(cfg, 0, sizeof(*cfg));
+    do {
+        seq   = read_seqbegin(&dev->counter_seq);
+        state = atomic_read(&dev->state);
+        if (ses && ses != dev->on_show)
+            state = (state & ~LEDLOCK_SESSION_FLAGS) | ses->flags;
+        cfg->time_display     = dev->time_display;
+        cfg->time_blank_digit = dev->time_blank_digit;
+        cfg->time_blank_value = dev->time_blank_value;
+    } while (ledlock_read_retry(dev, seq));
+
+    cfg->mask  = LEDLOCK_CFG_ALL;
+    cfg->flags = ledlock_status_flags(state);
+}
+
+// Records a lap of a session's count as of now into the device's ring. The
+//  same fixed work whatever is queued and nothing allocated, so the time
+//  between now and the sample is just the seqlock. When the ring is full
+//  the new lap is dropped, or with lap_overwrite the oldest, and counted.
+static void ledlock_lap(struct ledlock_dev *dev, struct ledlock_session *ses,
+                        u64 now)
+{
+    struct ledlock_lap lap;
+    unsigned long flags;
+    unsigned int seq;
+    u64 cap;
+    int state;
+
+    lap.time_ns = now;
+    do {
+        seq = read_seqbegin(&dev->counter_seq);
+        if (ses == dev->on_show) {
+            state = atomic_read(&dev->state);
+            cap   = dev->count_cap;
+        }
+        else {
+            state = ses->flags;
+            cap   = ses->count_cap;
+        }
+        lap.elapsed_ns = ledlock_session_elapsed(dev, ses, now);
+    } while (ledlock_read_retry(dev, seq));
+    lap.count = ledlock_core_count(lap.elapsed_ns, cap, state & LEDLOCK_WRAP);
+    lap.flags = ledlock_status_flags(state & LEDLOCK_SESSION_FLAGS);
+
+    spin_lock_irqsave(&dev->lap_lock, flags);
+        lap.seq = dev->lap_seq++;
+        if (!kfifo_is_full(&dev->lap_fifo)) {
+            kfifo_put(&dev->lap_fifo, lap);
+        }
+        else if (READ_ONCE(lap_overwrite)) {
+            kfifo_skip(&dev->lap_fifo);
+            kfifo_put(&dev->lap_fifo, lap);
+            ++dev->laps_dropped;
+        }
+        else ++dev->laps_dropped;
+    spin_unlock_irqrestore(&dev->lap_lock, flags);
+}
+
+// Moves up to req->max laps, oldest first, out to the user's array, a batch
+//  at a time so the copies happen outside the lock. Fills in how many went
+//  and the dropped total. Laps taken off the ring are lost if the copy fails.
+static int ledlock_laps_drain(struct ledlock_dev *dev, struct ledlock_laps *req)
+{
+    struct ledlock_lap __user *to = u64_to_user_ptr(req->laps);
+    struct ledlock_lap laps[16];
+    unsigned long flags;
+    unsigned int n;
+
+    req->count = 0;
+    for (;;) {
+        n = min_t(u32, req->max - req->count, ARRAY_SIZE(laps));
+        spin_lock_irqsave(&dev->lap_lock, flags);
+            n = kfifo_out(&dev->lap_fifo, laps, n);
+            req->dropped = dev->laps_dropped;
+        spin_unlock_irqrestore(&dev->lap_lock, flags);
+        if (!n) return 0;
+
+        if (copy_to_user(to + req->count, laps, n * sizeof(laps[0])))
+            return -EFAULT;
+        req->count += n;
+    }
+}
+
+// Traces a control ioctl entered at start, along with the settings it left
+//  behind. Those are only gathered while the tracepoint is enabled.
+static void ledlock_trace_config(struct ledlock_dev *dev, unsigned int cmd,
+                                 u64 start)
+{
+    struct ledlock_config cfg;
+    u64 now = ktime_get_ns();
+
+    if (!trace_ledlock_config_enabled()) return;
+    ledlock_get_config(dev, NULL, &cfg);
+    trace_ledlock_config(dev->minor, _IOC_NR(cmd), cfg.flags,
+                         cfg.time_display, cfg.time_blank_digit,
+                         cfg.time_blank_value, start, now);
+}
+
+long ledlock_ioctl(struct file* fp, unsigned int cmd, unsigned long arg) {
+    struct ledlock_file *lf = fp->private_data;
+    struct ledlock_dev *dev = lf->dev;
+    struct ledlock_config cfg;
+    struct ledlock_session_config scfg;
+    struct ledlock_laps laps;
+    unsigned long flags;
+    unsigned int events;
+    u64 start = ktime_get_ns();
+    bool changed, shown;
+    int result;
+    
+    atomic64_inc(&dev->counters.ioctls);
+    switch(cmd) {
+        case IOCTL_LEDLOCK_PON:     // pause timer
+            pr_debug("\t\tIOCTL pause\n");
+            // mark time if not already paused
+            write_seqlock_irqsave(&dev->counter_seq, flags);
+                shown   = lf->ses == dev->on_show;
+                changed = ledlock_session_pause_locked(dev, lf->ses, true);
+            write_sequnlock_irqrestore(&dev->counter_seq, flags);
+            ledlock_schedule(dev, false);   // turns stop once all are paused
+            if (!shown) break;
+            ledlock_engine_post(dev);
+            if (changed) ledlock_notify(dev, &dev->pause_events);
+            break;
+            
+        case IOCTL_LEDLOCK_POFF:    // unpause timer
+            pr_debug("\t\tIOCTL unpause\n");
+            // increment pause-counter if it was paused
+            write_seqlock_irqsave(&dev->counter_seq, flags);
+                shown   = lf->ses == dev->on_show;
+                changed = ledlock_session_pause_locked(dev, lf->ses, false);
+            write_sequnlock_irqrestore(&dev->counter_seq, flags);
+            ledlock_schedule(dev, false);   // ... and start again
+            if (!shown) break;
+            ledlock_engine_kick(dev);
+            if (changed) {
+                ledlock_notify(dev, &dev->pause_events);
+                ledlock_tick_restart(dev);
+            }
+            break;
+            
+        case IOCTL_LEDLOCK_DON:     // turn display on
+            pr_debug("\t\tIOCTL display on\n");
+            ledlock_set(dev, LEDLOCK_DISPLAY);
+            ledlock_engine_kick(dev);
+            break;
+            
+        case IOCTL_LEDLOCK_DOFF:    // turn display off
+            pr_debug("\t\tIOCTL display off\n");
+            ledlock_clear(dev, LEDLOCK_DISPLAY);
+            ledlock_engine_post(dev);
+            break;
+            
+        case IOCTL_LEDLOCK_WON:     // turn wrap on
+            pr_debug("\t\tIOCTL wrap on\n");
+            write_seqlock_irqsave(&dev->counter_seq, flags);
+                shown = ledlock_session_wrap_locked(dev, lf->ses, true);
+            write_sequnlock_irqrestore(&dev->counter_seq, flags);
+            if (!shown) break;
+            ledlock_engine_post(dev);
+            ledlock_tick_kick(dev); // a stopped count may be moving again
+            
+//            ledlock_display_value();
+            break;
+            
+        case IOCTL_LEDLOCK_WOFF:    // turn wrap off
+            pr_debug("\t\tIOCTL wrap off\n");
+            write_seqlock_irqsave(&dev->counter_seq, flags);
+                shown = ledlock_session_wrap_locked(dev, lf->ses, false);
+            write_sequnlock_irqrestore(&dev->counter_seq, flags);
+            if (shown) ledlock_engine_post(dev);
+            break;
+
+        case IOCTL_LEDLOCK_SHOW:    // set display length
+            pr_debug("\t\tIOCTL set display length\n");
+            if (arg > LEDLOCK_MAX_TIME_MS) return -EINVAL;
+            write_seqlock_irqsave(&dev->counter_seq, flags);
+                dev->time_display = arg;
+            write_sequnlock_irqrestore(&dev->counter_seq, flags);
+            break;
+            
+        case IOCTL_LEDLOCK_BLANK_DIGIT:   // set digit blank length
+            pr_debug("\t\tIOCTL set blank length\n");
+            if (arg > LEDLOCK_MAX_TIME_MS) return -EINVAL;
+            write_seqlock_irqsave(&dev->counter_seq, flags);
+                dev->time_blank_digit = arg;
+            write_sequnlock_irqrestore(&dev->counter_seq, flags);
+            break;
+        case IOCTL_LEDLOCK_BLANK_VALUE:   // set value blank length
+            pr_debug("\t\tIOCTL set blank length\n");
+            if (arg > LEDLOCK_MAX_TIME_MS) return -EINVAL;
+            write_seqlock_irqsave(&dev->counter_seq, flags);
+                dev->time_blank_value = arg;
+            write_sequnlock_irqrestore(&dev->counter_seq, flags);
+            break;
+
+        case IOCTL_LEDLOCK_SET_CONFIG:  // set several parameters at once
+            pr_debug("\t\tIOCTL set config\n");
+            if (copy_from_user(&cfg, (void __user *)arg, sizeof(cfg)))
+                return -EFAULT;
+            result = ledlock_set_config(dev, lf->ses, &cfg);
+            if (result) return result;
+            break;
+
+        case IOCTL_LEDLOCK_GET_CONFIG:  // read all parameters at once
+            ledlock_get_config(dev, lf->ses, &cfg);
+            if (copy_to_user((void __user *)arg, &cfg, sizeof(cfg)))
+                return -EFAULT;
+            break;
+
+        case IOCTL_LEDLOCK_MODE:    // counter cap or frame stream writes
+            pr_debug("\t\tIOCTL mode %lu\n", arg);
+            result = ledlock_set_mode(dev, arg);
+            if (result) return result;
+            break;
+
+        case IOCTL_LEDLOCK_EVENTS:  // collect and acknowledge poll events
+            events = ledlock_events(fp->private_data, true);
+            if (copy_to_user((unsigned int __user *)arg, &events,
+                             sizeof(events)))
+                return -EFAULT;
+            break;
+
+        case IOCTL_LEDLOCK_SESSION: // a timer session of this file's own
+            if (copy_from_user(&scfg, (void __user *)arg, sizeof(scfg)))
+                return -EFAULT;
+            pr_debug("\t\tIOCTL session priority %d\n", scfg.priority);
+            ledlock_session_open(lf, &scfg);
+            break;
+
+        case IOCTL_LEDLOCK_LAP:     // sample this file's count into the ring
+            ledlock_lap(dev, lf->ses, start);
+            return 0;
+
+        case IOCTL_LEDLOCK_LAPS:    // and drain what has been sampled
+            if (copy_from_user(&laps, (void __user *)arg, sizeof(laps)))
+                return -EFAULT;
+            result = ledlock_laps_drain(dev, &laps);
+            if (result) return result;
+            if (copy_to_user((void __user *)arg, &laps, sizeof(laps)))
+                return -EFAULT;
+            return 0;
+    }
+
+    if (cmd != IOCTL_LEDLOCK_GET_CONFIG && cmd != IOCTL_LEDLOCK_EVENTS)
+        ledlock_trace_config(dev, cmd, start);
+    ledlock_status_publish(dev);
+    return 0;
+}
+
+
+
+//=============================================================================
+//                              Timer Sessions
+//=============================================================================
+
+// Files share the device's count unless they ask for a session of their own.
+//  Every session, the shared one included, sits on the device's list, and
+//  the one on show keeps its counter in the device itself, so the engine,
+//  tick timer and status page carry on as if there were only the one.
+//  Switching sessions swaps the counters over and starts the engine on a
+//  fresh sequence, as a write does. The list, the counters and on_show are
+//  all kept under counter_seq.
+
+// Copies the device's counter back into the session on show. Called inside
+//  a counter_seq write section, as is ledlock_session_load().
+static void ledlock_session_save(struct ledlock_dev *dev) {
+    struct ledlock_session *ses = dev->on_show;
+
+    ses->count_cap      = dev->count_cap;
+    ses->write_ns       = dev->write_ns;
+    ses->pause_ns       = dev->pause_ns;
+    ses->pause_nsmarker = dev->pause_nsmarker;
+    ses->flags          = atomic_read(&dev->state) & LEDLOCK_SESSION_FLAGS;
+}
+
+// Puts a session's counter into the device, making it the one on show.
+static void ledlock_session_load(struct ledlock_dev *dev,
+                                 struct ledlock_session *ses)
+{
+    dev->count_cap      = ses->count_cap;
+    dev->write_ns       = ses->write_ns;
+    dev->pause_ns       = ses->pause_ns;
+    dev->pause_nsmarker = ses->pause_nsmarker;
+    ledlock_clear(dev, LEDLOCK_SESSION_FLAGS & ~ses->flags);
+    ledlock_set(dev, ses->flags);
+    dev->on_show = ses;
+
+    // no tick or cap event for jumping to another count
+    dev->tick_seconds = div_u64(ledlock_elapsed_ns(dev, ktime_get_ns()),
+                                NSEC_PER_SEC);
+}
+
+// ledlock_elapsed_ns() for a session, from the device if it is on show.
+//  Same locking rules.
+static u64 ledlock_session_elapsed(struct ledlock_dev *dev,
+                                   struct ledlock_session *ses, u64 now)
+{
+    if (ses == dev->on_show) return ledlock_elapsed_ns(dev, now);
+    if (!(ses->flags & LEDLOCK_WRITTEN)) return 0;
+    return ledlock_core_elapsed(now, ses->write_ns, ses->pause_ns,
+                                ses->pause_nsmarker,
+                                ses->flags & LEDLOCK_PAUSED);
+}
+
+// A session's count as of now, from the device if it is on show. Same
+//  locking rules as ledlock_elapsed_ns().
+static u64 ledlock_session_count(struct ledlock_dev *dev,
+                                 struct ledlock_session *ses)
+{
+    if (ses == dev->on_show) return ledlock_current_count(dev);
+    return ledlock_core_count(ledlock_session_elapsed(dev, ses,
+                                                      ktime_get_ns()),
+                              ses->count_cap, ses->flags & LEDLOCK_WRAP);
+}
+
+// Brings whatever follows the count over to a session newly on show. The
+//  engine restart blanks one that is paused or unwritten.
+static void ledlock_session_shown(struct ledlock_dev *dev) {
+    ledlock_engine_restart(dev);
+    ledlock_notify(dev, &dev->ticks);
+    ledlock_tick_restart(dev);
+    ledlock_status_publish(dev);
+}
+
+// Puts the right session on show: the highest priority of those written,
+//  taking turns among equals. The one on show keeps its turn unless rotate,
+//  once its slice has run out. Returns whether it switched. Called again
+//  whenever a session pauses or unpauses, as turns only run while one of
+//  those taking them has a count that moves.
+static bool ledlock_schedule(struct ledlock_dev *dev, bool rotate) {
+    struct ledlock_session *ses, *cur, *pick, *first = NULL, *next = NULL;
+    unsigned long flags;
+    unsigned int slice;
+    int top = INT_MIN, others = 0, waiting, priority;
+    bool past = false, moving = false, cur_ok, turns, arm;
+
+    write_seqlock_irqsave(&dev->counter_seq, flags);
+        cur = dev->on_show;
+        ledlock_session_save(dev);
+
+        list_for_each_entry(ses, &dev->sessions, node) {
+            if ((ses->flags & LEDLOCK_WRITTEN) && ses->priority > top)
+                top = ses->priority;
+        }
+
+        // the next in turn after the one on show, going round the list
+        list_for_each_entry(ses, &dev->sessions, node) {
+            if (ses == cur) past = true;
+            if (!(ses->flags & LEDLOCK_WRITTEN) || ses->priority != top)
+                continue;
+            if (!(ses->flags & LEDLOCK_PAUSED)) moving = true;
+            if (ses == cur) continue;
+            ++others;
+            if (!first) first = ses;
+            if (past && !next) next = ses;
+        }
+        cur_ok = (cur->flags & LEDLOCK_WRITTEN) && cur->priority == top;
+
+        pick = cur;
+        if (others && (!cur_ok || rotate)) pick = next ? next : first;
+        if (pick != cur) {
+            ledlock_session_load(dev, pick);
+            ++dev->counters.switches;
+        }
+
+        // Keep the slice timer going while others wait their turn, and
+        //  stop it once nobody does or every count taking turns is paused,
+        //  so a display left paused costs no wakeups. It is started and
+        //  stopped under the lock, so the last to decide always wins.
+        waiting = pick == cur ? others : others - 1 + cur_ok;
+        turns   = waiting && moving;
+        arm     = turns && (pick != cur || rotate || !dev->slicing);
+        slice   = pick->slice_ms ? pick->slice_ms : READ_ONCE(slice_ms);
+        if (arm) {
+            dev->slicing = true;
+            ledlock_timer_start(&dev->slice_timer,
+                                ktime_add_ms(ktime_get(), max(slice, 1U)));
+        }
+        else if (!turns && dev->slicing) {
+            dev->slicing = false;
+            ledlock_timer_try_to_cancel(&dev->slice_timer);
+        }
+        priority = pick->priority;     // pick may be closed once unlocked
+    write_sequnlock_irqrestore(&dev->counter_seq, flags);
+
+    if (pick == cur) return false;
+
+    pr_debug("ledlock%d showing session of priority %d\n", dev->minor,
+             priority);
+    ledlock_session_shown(dev);
+    return true;
+}
+
+// Slice timer callback, ending the turn of the session on show.
+static enum hrtimer_restart ledlock_slice_fn(struct ledlock_timer *timer) {
+    struct ledlock_dev *dev = container_of(timer, struct ledlock_dev,
+                                           slice_timer);
+
+    ++dev->counters.wakeups;
+    ledlock_schedule(dev, true);
+    return HRTIMER_NORESTART;
+}
+
+// Gives a file a timer session of its own, or changes the priority and slice
+//  of the one it has, then lets the scheduler reconsider. A new session
+//  takes the display's wrap setting and waits unwritten, so off the display.
+static void ledlock_session_open(struct ledlock_file *lf,
+                                 const struct ledlock_session_config *cfg)
+{
+    struct ledlock_dev *dev = lf->dev;
+    struct ledlock_session *ses = &lf->session;
+    unsigned long flags;
+
+    write_seqlock_irqsave(&dev->counter_seq, flags);
+        if (lf->ses == &dev->shared) {
+            memset(ses, 0, sizeof(*ses));
+            ses->flags = atomic_read(&dev->state) & LEDLOCK_WRAP;
+            list_add_tail(&ses->node, &dev->sessions);
+            lf->ses = ses;
+        }
+        ses->priority = cfg->priority;
+        ses->slice_ms = cfg->slice_ms;
+    write_sequnlock_irqrestore(&dev->counter_seq, flags);
+    ledlock_schedule(dev, false);
+}
+
+// Ends a file's session, handing the display back if it was on show.
+static void ledlock_session_close(struct ledlock_dev *dev,
+                                  struct ledlock_session *ses)
+{
+    unsigned long flags;
+    bool shown;
+
+    write_seqlock_irqsave(&dev->counter_seq, flags);
+        list_del(&ses->node);
+        shown = dev->on_show == ses;
+        if (shown) ledlock_session_load(dev, &dev->shared);
+    write_sequnlock_irqrestore(&dev->counter_seq, flags);
+    if (!ledlock_schedule(dev, false) && shown) ledlock_session_shown(dev);
+}
+
+
+
+//=============================================================================
+//                              Init & Cleanup
+//=============================================================================
+
+// Sets up one display, everything short of making it visible to userspace.
+static int ledlock_dev_init(struct ledlock_dev *dev, int minor) {
+    int result, state;
+    unsigned long flags;
+
+    dev->minor = minor;
+
+    // status page for mmap()
+    dev->status = (struct ledlock_status *)get_zeroed_page(GFP_KERNEL);
+    if (!dev->status) return -ENOMEM;
+    spin_lock_init(&dev->status_lock);
+
+    // initialize locks
+    seqlock_init(&dev->counter_seq);
+
+    // initialize state, pause will keep blank until write
+    state = LEDLOCK_PAUSED | LEDLOCK_DISPLAY | LEDLOCK_SCHEDULE;
+#if defined(WRAP) && defined(NOWRAP)
+#error "Only one of WRAP and NOWRAP can be defined at once"
+#elif defined(WRAP)
+    printk("WRAP defined\n");
+    state |= LEDLOCK_WRAP;
+#elif defined(NOWRAP)
+    printk("NOWRAP defined\n");
+#else
+    state |= LEDLOCK_WRAP;
+    printk("Default Wrap\n");
+#endif
+    atomic_set(&dev->state, state);
+    printk((state & LEDLOCK_WRAP) ? "WRAP: T\n" : "WRAP: F\n");
+
+    // initialize globals
+    write_seqlock_irqsave(&dev->counter_seq, flags);
+#ifdef DISPLAY
+        dev->time_display = DISPLAY;
+#else
+        dev->time_display = 200;
+#endif
+#ifdef BLANK_D
+        dev->time_blank_digit = BLANK_D;
+#else
+        dev->time_blank_digit = 50;
+#endif
+#ifdef BLANK_V
+        dev->time_blank_value = BLANK_V;
+#else
+        dev->time_blank_value = 200;
+#endif
+        dev->count           = 0;
+        dev->count_cap       = 0;
+
+        dev->write_ns        = 0;
+        dev->pause_ns        = 0;
+        dev->pause_nsmarker  = 0;
+
+        printk("Display: %u\n", dev->time_display);
+        printk("BlankD: %u\n",  dev->time_blank_digit);
+        printk("BlankV: %u\n",  dev->time_blank_value);
+    write_sequnlock_irqrestore(&dev->counter_seq, flags);
+
+    // the display engine stays parked until the first write
+    dev->engine.phase = LEDLOCK_PHASE_WAIT;
+    ledlock_timer_setup(&dev->timer, ledlock_timer_fn);
+
+    // and the tick timer until somebody polls
+    init_waitqueue_head(&dev->waitq);
+    ledlock_timer_setup(&dev->tick_timer, ledlock_tick_fn);
+
+    // and the stream timer until frames are queued
+    INIT_KFIFO(dev->stream_fifo);
+    mutex_init(&dev->stream_mutex);
+    ledlock_timer_setup(&dev->stream_timer, ledlock_stream_fn);
+
+    // laps are recorded straight into the ring, which is never reallocated
+    INIT_KFIFO(dev->lap_fifo);
+    spin_lock_init(&dev->lap_lock);
+
+    // every file shares the one count until it asks for a session
+    INIT_LIST_HEAD(&dev->sessions);
+    list_add(&dev->shared.node, &dev->sessions);
+    dev->on_show = &dev->shared;
+    ledlock_timer_setup(&dev->slice_timer, ledlock_slice_fn);
+
+    dev->counters.since_ns = ktime_get_ns();
+
+    // bring up the output, not knowing what it holds
+    dev->port_shadow = -1;
+    spin_lock_init(&dev->pardev_lock);
+    result = ledlock_backend_attach(dev);
+    if (result) {
+        free_page((unsigned long)dev->status);
+        return result;
+    }
+
+    // clear bits
+    ledlock_display_clear(dev);
+    ledlock_port_yield(dev);
+    ledlock_status_publish(dev);
+    return 0;
+}
+
+// Stops one display's timers and output. Its device must already be gone.
+static void ledlock_dev_exit(struct ledlock_dev *dev) {
+    // stop further scheduling
+    ledlock_clear(dev, LEDLOCK_SCHEDULE);
+
+    // wait out a running step and stop the engine
+    ledlock_timer_cancel(&dev->timer);
+    ledlock_timer_cancel(&dev->tick_timer);
+    ledlock_timer_cancel(&dev->stream_timer);
+    ledlock_timer_cancel(&dev->slice_timer);
+
+    // clear bits, whatever the shadow says
+    dev->port_shadow = -1;
+    ledlock_display_clear(dev);
+    ledlock_backend_detach(dev);
+
+    free_page((unsigned long)dev->status);
+}
+
+int ledlock_init(void) {
+    int result, i, live = 0;
+    
+    printk("\nInitializing ledlock module...\n");
+    if (LEDLOCK_INITIALIZED) {
+        printk("ERROR: Already initialized!\n");
+        return 1;
+    }
+    LEDLOCK_INITIALIZED = true;
+
+    // one display per port given, or as many as asked for
+    devices = max3(devices, nport, nparport);
+    if (devices < 1 || devices > LEDLOCK_MAX_DEVICES) {
+        printk("ERROR: Between 1 and %d devices, please\n",
+               LEDLOCK_MAX_DEVICES);
+        return -EINVAL;
+    }
+
+    ledlock_devs = kcalloc(devices, sizeof(*ledlock_devs), GFP_KERNEL);
+    if (!ledlock_devs) return -ENOMEM;
+        
+    // the shared timer, idle until a display needs it
+    result = ledlock_wheel_init();
+    if (result) {
+        kfree(ledlock_devs);
+        return result;
+    }
+
+    result = alloc_chrdev_region(&ledlock_devt, 0, devices, "ledlock");
+    if (result < 0) {
+        printk("ERROR: Cannot allocate device numbers\n");
+        goto fail_region;
+    }
+    
+    for (i = 0; i < devices; ++i) {
+        // the parport backend wants these before it is probed, so fill them
+        //  in for all displays up front
+        ledlock_devs[i].port    = port[i];
+        ledlock_devs[i].parport = parport[i];
+    }
+
+    // bring up the output and every display, before any can be opened
+    result = ledlock_backend_init();
+    if (result) goto fail_backend;
+
+    for (i = 0; i < devices; ++i) {
+        result = ledlock_dev_init(&ledlock_devs[i], i);
+        if (result) goto fail_devs;
+        ++live;
+    }
+
+    // register devices, now that they are ready
+    for (i = 0; i < devices; ++i) {
+        cdev_init(&ledlock_devs[i].cdev, &ledlock_fops);
+        ledlock_devs[i].cdev.owner = THIS_MODULE;
+        result = cdev_add(&ledlock_devs[i].cdev, ledlock_devt + i, 1);
+        if (result) {
+            printk("ERROR: Cannot register device %d\n", i);
+            goto fail_cdev;
+        }
+    }
+
+    printk("Module initialized with %d displays on major %d!\n", devices,
+           MAJOR(ledlock_devt));
+    return 0;
+
+fail_cdev:
+    while (i--) cdev_del(&ledlock_devs[i].cdev);
+fail_devs:
+    while (live--) ledlock_dev_exit(&ledlock_devs[live]);
+    ledlock_backend_exit();
+fail_backend:
+    unregister_chrdev_region(ledlock_devt, devices);
+fail_region:
+    ledlock_wheel_exit();
+    kfree(ledlock_devs);
+    return result;
+}
+
+
+void ledlock_cleanup(void) {
+    int i;
+
+    printk("Removing ledlock module...\n");
+
+    // unregister devices, so nothing new comes in
+    for (i = 0; i < devices; ++i) cdev_del(&ledlock_devs[i].cdev);
+    unregister_chrdev_region(ledlock_devt, devices);
+    
+    for (i = 0; i < devices; ++i) ledlock_dev_exit(&ledlock_devs[i]);
+    ledlock_backend_exit();
+
+    // every display's timers are stopped, so nothing re-arms the shared one
+    ledlock_wheel_exit();
+    kfree(ledlock_devs);
+    
+    printk("Module removed!\n");
+}
+
+
+
+module_init(ledlock_init);
+module_exit(ledlock_cleanup);
@@ -8,31 +8,174 @@ This file contains code which will allow for a timer device as described in
 See the included README file for explanations beyond the comments herein.
 */
 
-
+#ifndef LEDLOCK_H
+#define LEDLOCK_H
 
 
 #include <linux/ioctl.h>
+#include <linux/types.h>
 
 
 
 // constants
-#define LEDLOCK_MAJOR       399
+// The ioctl type field, which was the fixed major number before the major
+//  became dynamic. Kept at the old value so existing binaries still work.
+#define LEDLOCK_IOC_MAGIC   399
 
 // IOCTL definitions
-#define IOCTL_LEDLOCK_PON   _IO(LEDLOCK_MAJOR, 0)   // pause timer
-#define IOCTL_LEDLOCK_POFF  _IO(LEDLOCK_MAJOR, 1)   // unpause timer
-#define IOCTL_LEDLOCK_DON   _IO(LEDLOCK_MAJOR, 2)   // turn display on
-#define IOCTL_LEDLOCK_DOFF  _IO(LEDLOCK_MAJOR, 3)   // turn display off
-#define IOCTL_LEDLOCK_WON   _IO(LEDLOCK_MAJOR, 4)   // turn wrap on
-#define IOCTL_LEDLOCK_WOFF  _IO(LEDLOCK_MAJOR, 5)   // turn wrap off
+#define IOCTL_LEDLOCK_PON   _IO(LEDLOCK_IOC_MAGIC, 0)   // pause timer
+#define IOCTL_LEDLOCK_POFF  _IO(LEDLOCK_IOC_MAGIC, 1)   // unpause timer
+#define IOCTL_LEDLOCK_DON   _IO(LEDLOCK_IOC_MAGIC, 2)   // turn display on
+#define IOCTL_LEDLOCK_DOFF  _IO(LEDLOCK_IOC_MAGIC, 3)   // turn display off
+#define IOCTL_LEDLOCK_WON   _IO(LEDLOCK_IOC_MAGIC, 4)   // turn wrap on
+#define IOCTL_LEDLOCK_WOFF  _IO(LEDLOCK_IOC_MAGIC, 5)   // turn wrap off
 
 // set the length of time to show digit
-#define IOCTL_LEDLOCK_SHOW  _IOR(LEDLOCK_MAJOR, 6, unsigned int) 
+#define IOCTL_LEDLOCK_SHOW  _IOR(LEDLOCK_IOC_MAGIC, 6, unsigned int) 
 
 // set length of time to have blank display between digits
-#define IOCTL_LEDLOCK_BLANK_DIGIT _IOR(LEDLOCK_MAJOR, 7, unsigned int) 
+#define IOCTL_LEDLOCK_BLANK_DIGIT _IOR(LEDLOCK_IOC_MAGIC, 7, unsigned int) 
 
 // set length of time to have blank display between digit sequences
-#define IOCTL_LEDLOCK_BLANK_VALUE _IOR(LEDLOCK_MAJOR, 8, unsigned int) 
+#define IOCTL_LEDLOCK_BLANK_VALUE _IOR(LEDLOCK_IOC_MAGIC, 8, unsigned int) 
+
+// longest any of the three timings may be set to, in ms; longer is EINVAL
+#define LEDLOCK_MAX_TIME_MS 60000
+
+// collect LEDLOCK_EVENT_* bits not yet seen by this file, acknowledging them
+#define IOCTL_LEDLOCK_EVENTS _IOR(LEDLOCK_IOC_MAGIC, 9, unsigned int)
+
+// set or read several parameters as one atomic update, see ledlock_config
+#define IOCTL_LEDLOCK_SET_CONFIG \
+        _IOW(LEDLOCK_IOC_MAGIC, 10, struct ledlock_config)
+#define IOCTL_LEDLOCK_GET_CONFIG \
+        _IOR(LEDLOCK_IOC_MAGIC, 11, struct ledlock_config)
+
+// choose what write() takes, passing one of LEDLOCK_MODE_* as the argument
+#define IOCTL_LEDLOCK_MODE  _IOW(LEDLOCK_IOC_MAGIC, 12, unsigned int)
+
+#define LEDLOCK_MODE_COUNT  0   // a new counter cap, the default
+#define LEDLOCK_MODE_STREAM 1   // ledlock_frame_record frames to play in turn
+
+// give this open file a timer session of its own, see ledlock_session_config
+#define IOCTL_LEDLOCK_SESSION \
+        _IOW(LEDLOCK_IOC_MAGIC, 13, struct ledlock_session_config)
+
+// record a lap of this file's count, and drain recorded laps, see ledlock_lap
+#define IOCTL_LEDLOCK_LAP   _IO(LEDLOCK_IOC_MAGIC, 14)
+#define IOCTL_LEDLOCK_LAPS  _IOWR(LEDLOCK_IOC_MAGIC, 15, struct ledlock_laps)
+
+// poll events
+//  A tick makes the device readable (POLLIN) until the count is read. Cap
+//  and pause events are priority data (POLLPRI) until IOCTL_LEDLOCK_EVENTS.
+#define LEDLOCK_EVENT_TICK  (1 << 0)    // the count changed
+#define LEDLOCK_EVENT_CAP   (1 << 1)    // the count reached the cap or wrapped
+#define LEDLOCK_EVENT_PAUSE (1 << 2)    // the timer was paused or unpaused
+
+
+// one frame for LEDLOCK_MODE_STREAM, write() takes any number at once
+//  Frames are queued in the driver and played back to back by its timer, so
+//  an animation needs no system call per frame. Writes block while the queue
+//  is full, or fail with EAGAIN if non-blocking; poll() reports POLLOUT once
+//  there is room again.
+struct ledlock_frame_record {
+    __u32 duration_us;  // how long to show this frame before the next
+    __u8  segments;     // byte to write to the data register
+    __u8  pad[3];
+};
+
+
+// record of one byte written to the simulated port (backend=sim), as read
+//  from /sys/kernel/debug/ledlock/sim
+struct ledlock_sim_record {
+    __u64 time_ns;      // CLOCK_MONOTONIC time of the write
+    __u8  segments;     // byte written to the data register
+    __u8  pad[7];
+};
+
+
+// shared status page, mapped read-only with mmap() on the device
+//  The kernel makes seq odd while it updates the page and even again after,
+//  so readers retry while seq is odd or changed under them. ledlock_status.h
+//  has a reader that does this and works the current count out from the
+//  timestamps, which stay valid between updates.
+struct ledlock_status {
+    __u32 seq;
+    __u32 flags;            // LEDLOCK_STATUS_* bits
+    __u64 count;            // count as of the last update
+    __u64 cap;              // counter cap from the last write
+    __u64 write_ns;         // CLOCK_MONOTONIC time of the last write
+    __u64 pause_ns;         // time spent paused since then
+    __u64 pause_start_ns;   // start of the current pause, if paused
+    __u8  last_digit;       // segments last shown on the display
+    __u8  pad[7];
+};
+
+#define LEDLOCK_STATUS_PAUSED   (1 << 0)
+#define LEDLOCK_STATUS_WRAP     (1 << 1)
+#define LEDLOCK_STATUS_DISPLAY  (1 << 2)
+#define LEDLOCK_STATUS_WRITTEN  (1 << 3)
+#define LEDLOCK_STATUS_STREAM   (1 << 4)    // in LEDLOCK_MODE_STREAM
+
+
+// batched configuration
+//  SET_CONFIG applies only the fields selected by mask and leaves the rest
+//  alone; the flags word uses the LEDLOCK_STATUS_* bits. Everything selected
+//  takes effect together, the display never runs with half of the change.
+//  GET_CONFIG fills in every field and sets mask to LEDLOCK_CFG_ALL.
+struct ledlock_config {
+    __u32 mask;                 // LEDLOCK_CFG_* bits
+    __u32 flags;                // pause, wrap and display state
+    __u32 time_display;         // ms each digit is shown
+    __u32 time_blank_digit;     // ms blank between digits
+    __u32 time_blank_value;     // ms blank between values
+};
+
+#define LEDLOCK_CFG_PAUSE        (1 << 0)
+#define LEDLOCK_CFG_WRAP         (1 << 1)
+#define LEDLOCK_CFG_DISPLAY      (1 << 2)
+#define LEDLOCK_CFG_TIME_DISPLAY (1 << 3)
+#define LEDLOCK_CFG_BLANK_DIGIT  (1 << 4)
+#define LEDLOCK_CFG_BLANK_VALUE  (1 << 5)
+#define LEDLOCK_CFG_ALL          0x3f
+
+
+// timer session of one open file
+//  By default every open file shares the one count. After IOCTL_LEDLOCK_SESSION
+//  this file's write(), read(), pause and wrap act on a count of its own
+//  instead, which keeps running whether shown or not. Of the sessions that
+//  have been written, the display shows the one with the highest priority,
+//  taking turns of slice_ms among equals. Display on/off, the timings and
+//  poll events stay shared by the whole device. Calling it again changes
+//  priority and slice; the session ends when the file is closed.
+struct ledlock_session_config {
+    __s32 priority;             // the shared count has priority 0
+    __u32 slice_ms;             // turn among equals, 0 for the module default
+};
+
+
+// lap history
+//  IOCTL_LEDLOCK_LAP samples the count, as read() would, into a ring in the
+//  driver, stamped with the time the ioctl was entered. IOCTL_LEDLOCK_LAPS
+//  then drains up to max laps, oldest first, in one call. The ring holds
+//  LEDLOCK_LAP_RECORDS laps; once full a new lap is dropped, or with the
+//  lap_overwrite module parameter the oldest one is. Either way it counts
+//  in dropped and leaves a gap in the lap numbers.
+struct ledlock_lap {
+    __u64 time_ns;      // CLOCK_MONOTONIC time of the lap
+    __u64 count;        // the count at that moment
+    __u64 elapsed_ns;   // counted since the write, pauses left out
+    __u32 flags;        // LEDLOCK_STATUS_* of the count, paused, wrap...
+    __u32 seq;          // lap number on this display
+};
+
+struct ledlock_laps {
+    __u64 laps;         // user pointer to an array of struct ledlock_lap
+    __u32 max;          // room in it
+    __u32 count;        // laps copied into it
+    __u64 dropped;      // laps lost to a full ring since the module loaded
+};
 
+#define LEDLOCK_LAP_RECORDS 256
 
+#endif
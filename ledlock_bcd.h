@@ -0,0 +1,88 @@
+/*  Code by Preston Hamlin
+Packed BCD counter for the display engine. The shown value is kept as one
+    decimal digit per nibble of a 64 bit word, least significant digit in the
+    low nibble, so moving on to the next second is a handful of adds rather
+    than a full divide-and-reverse conversion.
+
+Only uses what both the kernel and userspace provide, so the test programs
+    can include it as well.
+*/
+
+#ifndef LEDLOCK_BCD_H
+#define LEDLOCK_BCD_H
+
+#include <linux/types.h>
+#ifdef __KERNEL__
+#include <linux/math64.h>
+#endif
+
+// most digits a packed value holds, one per nibble
+#define LEDLOCK_BCD_DIGITS  16
+
+
+// Splits the lowest decimal digit off a value, without a 64 bit division
+//  that 32 bit kernels have no instruction for.
+static inline unsigned int ledlock_bcd_div10(__u64 *val) {
+#ifdef __KERNEL__
+    __u32 rem;
+
+    *val = div_u64_rem(*val, 10, &rem);
+    return rem;
+#else
+    unsigned int rem = *val % 10;
+
+    *val /= 10;
+    return rem;
+#endif
+}
+
+
+// Converts a count to packed BCD from scratch. Digits beyond
+//  LEDLOCK_BCD_DIGITS are dropped, which a count of seconds never reaches.
+static inline __u64 ledlock_bcd_from(__u64 val) {
+    __u64 bcd = 0;
+    int shift = 0;
+
+    do {
+        bcd |= (__u64)ledlock_bcd_div10(&val) << shift;
+        shift += 4;
+    } while (val && shift < 4 * LEDLOCK_BCD_DIGITS);
+
+    return bcd;
+}
+
+// Adds one to a packed BCD value in place. Every digit is biased by 6 so that
+//  a 9 carries straight out of its nibble, then the bias is taken back out of
+//  each digit that did not carry.
+static inline __u64 ledlock_bcd_inc(__u64 bcd) {
+    __u64 biased = bcd + 0x0666666666666666ULL;
+    __u64 sum    = biased + 1;
+    __u64 kept   = ~(sum ^ biased ^ 1) & 0x1111111111111110ULL;
+
+    return sum - ((kept >> 2) | (kept >> 3));
+}
+
+// Brings a packed count from one value up to another, incrementing in place
+//  when the count has moved on by one, as it does every second, and falling
+//  back to a full conversion after a skip, a resume or a new write.
+static inline __u64 ledlock_bcd_advance(__u64 bcd, __u64 from, __u64 to) {
+    if (to == from) return bcd;
+    if (to == 0) return 0;      // wrapped against the cap
+    if (to == from + 1) return ledlock_bcd_inc(bcd);
+    return ledlock_bcd_from(to);
+}
+
+// number of digits in a packed value, at least one
+static inline int ledlock_bcd_len(__u64 bcd) {
+    int len = 1;
+
+    while (bcd >>= 4) ++len;
+    return len;
+}
+
+// digit i of a packed value, counting from the least significant
+static inline int ledlock_bcd_digit(__u64 bcd, int i) {
+    return (bcd >> (4 * i)) & 0xf;
+}
+
+#endif
@@ -0,0 +1,330 @@
+/*  Code by Preston Hamlin
+Timing and rendering core of the display engine: the count as a function of
+    time, pausing and resuming it, where the next second falls, the frames a
+    value is shown as, and the state machine that plays them. Everything here
+    works only on its arguments, the clock included, and reaches the port
+    through the hooks in struct ledlock_core_ops, so the module runs it
+    against the real time and tests/coresim.c against a virtual clock and a
+    fake port, putting a day of operation through it in seconds.
+
+Like ledlock_bcd.h, only uses what both the kernel and userspace provide.
+*/
+
+#ifndef LEDLOCK_CORE_H
+#define LEDLOCK_CORE_H
+
+#include "ledlock_bcd.h"
+
+#ifndef __KERNEL__
+#include <stdbool.h>
+#endif
+
+#define LEDLOCK_NSEC_PER_SEC    1000000000ULL
+
+// segment bits
+#define SEG_B   0b00000001
+#define SEG_BL  0b00000010
+#define SEG_M   0b00000100
+#define SEG_BR  0b00001000
+#define SEG_T   0b00010000
+#define SEG_TR  0b00100000
+#define SEG_TL  0b01000000
+#define SEG_INT 0b10000000
+
+// digits
+#define L_DIGIT_0   (SEG_B | SEG_BL | SEG_TL | SEG_T | SEG_TR | SEG_BR)
+#define L_DIGIT_1   (SEG_TR | SEG_BR)
+#define L_DIGIT_2   (SEG_T | SEG_TR | SEG_M | SEG_BL | SEG_B)
+#define L_DIGIT_3   (SEG_T | SEG_TR | SEG_BR | SEG_M | SEG_B)
+#define L_DIGIT_4   (SEG_TL | SEG_M | SEG_TR | SEG_BR)
+#define L_DIGIT_5   (SEG_T | SEG_TL | SEG_M | SEG_BR | SEG_B)
+#define L_DIGIT_6   (SEG_T | SEG_TL | SEG_BL | SEG_B | SEG_BR | SEG_M)
+#define L_DIGIT_7   (SEG_T | SEG_TR | SEG_BR)
+#define L_DIGIT_8   (SEG_B | SEG_BL | SEG_TL | SEG_T | SEG_TR | SEG_BR | SEG_M)
+#define L_DIGIT_9   (SEG_B | SEG_TL | SEG_T | SEG_TR | SEG_BR | SEG_M)
+
+// one frame of a display program: what to put on the port and for how long
+struct ledlock_frame {
+    unsigned int duration;      // ms until the next frame
+    char segments;              // segments to show, 0 to blank
+    bool latch;                 // write segments, or leave the port alone
+};
+
+// A value compiles to a digit frame followed by a gap frame for each digit,
+//  so even frames show digits and odd frames are the gaps between them.
+#define LEDLOCK_MAX_FRAMES  (2 * LEDLOCK_BCD_DIGITS)
+
+// Delays an engine step can return besides a frame's duration, which is
+//  never more than LEDLOCK_MAX_TIME_MS so can't be mistaken for these.
+// returned by a step that has parked rather than re-armed
+#define LEDLOCK_IDLE        (~0U)
+// ... or that waits for the next second of the count
+#define LEDLOCK_SECOND      (~0U - 1)
+// ... or that finds a control command needs nothing done
+#define LEDLOCK_RESUME      (~0U - 2)
+
+// states of the display engine, named for what is currently on the display
+enum ledlock_phase {
+    LEDLOCK_PHASE_WAIT,         // idle, waiting for the next second boundary
+    LEDLOCK_PHASE_FRAME,        // playing a frame of the display program
+    LEDLOCK_PHASE_PAUSED,       // holding the last digit until unpaused
+};
+
+// the display engine's own state, only touched from its timer
+struct ledlock_core_engine {
+    enum ledlock_phase phase;           // current engine state
+    enum ledlock_phase resume_phase;    // state to return to on unpause
+    struct ledlock_frame program[LEDLOCK_MAX_FRAMES];
+    unsigned int program_len;           // frames in the program
+    unsigned int frame_index;           // frame currently playing
+    char last_digit;                    // segments it last latched
+    bool shown;                         // count displayed since the write
+};
+
+// What the engine does besides stepping through its states, each hook
+//  getting back the ctx the step was given.
+struct ledlock_core_ops {
+    void (*latch)(void *ctx, char segments);    // onto the port, 0 blanks
+    void (*frame)(void *ctx, char segments, unsigned int duration); // played
+    void (*pause)(void *ctx, bool paused);      // froze on or moved on from
+    void (*yield)(void *ctx);                   // between sequences, parked
+    // compiles the count as of now into the program, shown still saying
+    //  whether one was shown before
+    void (*load)(void *ctx);
+    // parks, returning LEDLOCK_IDLE, or 0 if it must carry on after all
+    unsigned int (*park)(void *ctx);
+};
+
+
+// 64 by 64 bit division, through the kernel's helper on 32 bit machines
+static inline __u64 ledlock_core_div(__u64 a, __u64 b, __u64 *rem) {
+#ifdef __KERNEL__
+    return div64_u64_rem(a, b, rem);
+#else
+    *rem = a % b;
+    return a / b;
+#endif
+}
+
+// Nanoseconds counted as of now, from a write at write_ns less pause_ns
+//  spent paused. While paused this is frozen at pause_marker, when the
+//  pause began.
+static inline __u64 ledlock_core_elapsed(__u64 now, __u64 write_ns,
+                                         __u64 pause_ns, __u64 pause_marker,
+                                         bool paused)
+{
+    if (paused) now = pause_marker;
+    return now - write_ns - pause_ns;
+}
+
+// Starts a pause of a count at now; its elapsed time stays frozen there
+//  until ledlock_core_resume().
+static inline void ledlock_core_pause(__u64 now, __u64 *pause_marker) {
+    *pause_marker = now;
+}
+
+// Ends a pause begun at pause_marker, adding its length to pause_ns so the
+//  count carries on from where it froze. Returns the length.
+static inline __u64 ledlock_core_resume(__u64 now, __u64 *pause_ns,
+                                        __u64 pause_marker)
+{
+    *pause_ns += now - pause_marker;
+    return now - pause_marker;
+}
+
+// The count after elapsed ns: whole seconds, going back round to 0 at the
+//  cap if wrapping, or else stopping there. A cap of 0, as before the first
+//  write, holds the count at 0 either way.
+static inline __u64 ledlock_core_count(__u64 elapsed, __u64 cap, bool wrap) {
+    __u64 rem, val = ledlock_core_div(elapsed, LEDLOCK_NSEC_PER_SEC, &rem);
+
+    if (wrap && cap) {
+        if (val >= cap) {
+            ledlock_core_div(val, cap, &rem);
+            return rem;
+        }
+        return val;
+    }
+    return val < cap ? val : cap;       // if not wrapping, get the minimum
+}
+
+// Moves an absolute deadline on by whole intervals until it is after now,
+//  like hrtimer_forward(), so a run of deadlines keeps its phase however
+//  late any one of them was serviced.
+static inline __u64 ledlock_core_forward(__u64 expires, __u64 now,
+                                         __u64 interval)
+{
+    __u64 rem;
+
+    if (expires > now) return expires;
+    return expires +
+           (ledlock_core_div(now - expires, interval, &rem) + 1) * interval;
+}
+
+// Compiles a value, given as packed BCD, into display frames and returns how
+//  many. Each digit is shown for the dwell time, then blanked for the gap
+//  after it if wrapping, or else left latched.
+static inline unsigned int ledlock_core_compile(struct ledlock_frame *frames,
+                                                __u64 bcd, bool wrap,
+                                                unsigned int time_display,
+                                                unsigned int time_blank_digit,
+                                                unsigned int time_blank_value)
+{
+    static const char glyphs[10] = {
+        L_DIGIT_0, L_DIGIT_1, L_DIGIT_2, L_DIGIT_3, L_DIGIT_4,
+        L_DIGIT_5, L_DIGIT_6, L_DIGIT_7, L_DIGIT_8, L_DIGIT_9,
+    };
+    struct ledlock_frame *frame = frames;
+    int i, digit;
+
+    for (i = ledlock_bcd_len(bcd) - 1; i >= 0; --i) {
+        digit = ledlock_bcd_digit(bcd, i);
+        if (digit > 9) break;           // not BCD, show what came before
+
+        frame->segments = glyphs[digit];
+        frame->duration = time_display;
+        frame->latch    = true;
+        ++frame;
+
+        frame->segments = 0;
+        frame->duration = i ? time_blank_digit : time_blank_value;
+        frame->latch    = wrap;
+        ++frame;
+    }
+
+    return frame - frames;
+}
+
+
+// Enters the paused state, remembering where to pick up once unpaused. The
+//  last digit stays latched on the port while the engine is parked.
+static inline unsigned int
+ledlock_core_enter_pause(struct ledlock_core_engine *eng,
+                         const struct ledlock_core_ops *ops, void *ctx,
+                         enum ledlock_phase resume)
+{
+    eng->resume_phase = resume;
+    eng->phase        = LEDLOCK_PHASE_PAUSED;
+    ops->latch(ctx, eng->last_digit);
+    ops->pause(ctx, true);
+    ops->yield(ctx);
+    return ops->park(ctx);
+}
+
+// Blanks the display and parks until the display is turned back on, at which
+//  point a fresh digit sequence is started.
+static inline unsigned int
+ledlock_core_enter_dark(struct ledlock_core_engine *eng,
+                        const struct ledlock_core_ops *ops, void *ctx)
+{
+    eng->phase = LEDLOCK_PHASE_WAIT;
+    eng->shown = false;                 // seconds in the dark were not missed
+    ops->latch(ctx, 0);
+    ops->frame(ctx, 0, 0);
+    ops->yield(ctx);
+    return ops->park(ctx);
+}
+
+// Plays the frame at frame_index and returns how long it lasts. Once the
+//  program has run out, waits for the next second instead.
+static inline unsigned int
+ledlock_core_play_frame(struct ledlock_core_engine *eng,
+                        const struct ledlock_core_ops *ops, void *ctx)
+{
+    const struct ledlock_frame *frame;
+
+    if (eng->frame_index >= eng->program_len) {
+        eng->phase = LEDLOCK_PHASE_WAIT;
+        ops->yield(ctx);
+        return LEDLOCK_SECOND;
+    }
+
+    frame = &eng->program[eng->frame_index];
+    if (frame->latch) {
+        if (frame->segments) eng->last_digit = frame->segments;
+        ops->latch(ctx, frame->segments);
+    }
+    ops->frame(ctx, frame->segments, frame->duration);
+
+    eng->phase = LEDLOCK_PHASE_FRAME;
+    return frame->duration;
+}
+
+// Advances the display engine by one step each time its timer expires.
+//  Rather than sleeping between digits, each step plays one frame of the
+//  program loaded for the current value and returns how long, in ms, until
+//  the next step is due:
+//
+//      WAIT -> FRAME -> FRAME ... -> WAIT
+//
+//  Pause and display-off are noticed before each digit is shown. Rather than
+//  polling, the engine then parks with no timer armed and is kicked back into
+//  life by whatever unpauses it, turns the display on, or writes a new cap.
+//  A return of 0 means the next step is due immediately, LEDLOCK_SECOND that
+//  it is due on the next second of the count, and LEDLOCK_IDLE that the
+//  engine has parked.
+static inline unsigned int
+ledlock_core_step(struct ledlock_core_engine *eng,
+                  const struct ledlock_core_ops *ops, void *ctx,
+                  bool written, bool paused, bool display)
+{
+    switch (eng->phase) {
+        case LEDLOCK_PHASE_WAIT:        // start of a new second
+            if (!written) return ops->park(ctx);
+            if (paused)
+                return ledlock_core_enter_pause(eng, ops, ctx,
+                                                LEDLOCK_PHASE_WAIT);
+            if (!display) return ledlock_core_enter_dark(eng, ops, ctx);
+
+            ops->load(ctx);
+            eng->shown       = true;
+            eng->frame_index = 0;
+            return ledlock_core_play_frame(eng, ops, ctx);
+
+        case LEDLOCK_PHASE_FRAME:       // frame is up, on to the next
+            if (eng->frame_index % 2 &&
+                eng->frame_index + 1 < eng->program_len) {
+                if (paused)
+                    return ledlock_core_enter_pause(eng, ops, ctx,
+                                                    LEDLOCK_PHASE_FRAME);
+                if (!display) return ledlock_core_enter_dark(eng, ops, ctx);
+            }
+
+            ++eng->frame_index;
+            return ledlock_core_play_frame(eng, ops, ctx);
+
+        case LEDLOCK_PHASE_PAUSED:      // kicked while parked
+            if (paused) return ops->park(ctx);
+
+            // pick up again with the frame that the pause cut into
+            ops->pause(ctx, false);
+            eng->phase = eng->resume_phase;
+            if (eng->phase == LEDLOCK_PHASE_FRAME)
+                return ledlock_core_play_frame(eng, ops, ctx);
+            return 0;
+    }
+
+    return LEDLOCK_SECOND;
+}
+
+// Acts on a control command that cut the current frame or wait short:
+//  pausing or blanking at once, or starting the digit sequence over if wrap
+//  changed under the program. Returns LEDLOCK_RESUME if none of that
+//  applies, as when the command was undone before the engine got to it.
+static inline unsigned int
+ledlock_core_preempt(struct ledlock_core_engine *eng,
+                     const struct ledlock_core_ops *ops, void *ctx,
+                     bool paused, bool display, bool rewrap)
+{
+    if (eng->phase == LEDLOCK_PHASE_PAUSED) return 0;
+    if (paused) return ledlock_core_enter_pause(eng, ops, ctx, eng->phase);
+    if (!display) return ledlock_core_enter_dark(eng, ops, ctx);
+
+    if (rewrap) {
+        eng->phase = LEDLOCK_PHASE_WAIT;
+        return 0;
+    }
+    return LEDLOCK_RESUME;
+}
+
+#endif
@@ -0,0 +1,407 @@
+/*  Code by Preston Hamlin
+KUnit suite for the display engine's pure logic in ledlock_core.h and
+    ledlock_bcd.h: the digit conversion that replaced itoa(), the count's
+    wrap and clamp against the cap, pause accounting, the frames a value
+    compiles to and the engine playing them through a pause, with timed runs
+    of the render path. None of it touches the port, so it runs under
+    kunit.py on UML or QEMU, or as ledlock_kunit.ko.
+*/
+
+#include <kunit/test.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+
+#include "ledlock_core.h"
+
+MODULE_AUTHOR ("Preston Hamlin");
+MODULE_LICENSE("Dual BSD/GPL");
+
+
+// rounds of each timed run
+#define LEDLOCK_BENCH_ROUNDS    1000000
+
+// results land here so the timed loops are not optimized away
+static volatile __u64 ledlock_sink;
+
+static const char ledlock_glyphs[10] = {
+    L_DIGIT_0, L_DIGIT_1, L_DIGIT_2, L_DIGIT_3, L_DIGIT_4,
+    L_DIGIT_5, L_DIGIT_6, L_DIGIT_7, L_DIGIT_8, L_DIGIT_9,
+};
+
+
+//===========================================================================
+//  Digit conversion
+//===========================================================================
+
+// A packed BCD value printed in hex reads the same as the count in decimal,
+//  which makes the kernel's own number formatting the reference.
+static void ledlock_expect_bcd(struct kunit *test, __u64 val, __u64 bcd) {
+    char dec[24], hex[24];
+
+    snprintf(dec, sizeof(dec), "%llu", val);
+    snprintf(hex, sizeof(hex), "%llx", bcd);
+    KUNIT_EXPECT_STREQ_MSG(test, hex, dec, "value %llu", val);
+    KUNIT_EXPECT_EQ_MSG(test, ledlock_bcd_len(bcd), (int)strlen(dec),
+                        "value %llu", val);
+}
+
+// every power of ten and its neighbours, up to the 16 digits a word holds
+static void ledlock_test_bcd_from(struct kunit *test) {
+    __u64 p, val;
+    int d;
+
+    ledlock_expect_bcd(test, 0, ledlock_bcd_from(0));
+    for (p = 1; p <= 1000000000000000ULL; p *= 10) {
+        for (val = p - 1; val <= p + 1; ++val)
+            ledlock_expect_bcd(test, val, ledlock_bcd_from(val));
+    }
+    for (d = 1; d <= 9; ++d) {                          // repeated digits
+        val = 1111111111111111ULL * d;
+        ledlock_expect_bcd(test, val, ledlock_bcd_from(val));
+    }
+    ledlock_expect_bcd(test, 9999999999999999ULL,
+                       ledlock_bcd_from(9999999999999999ULL));
+    ledlock_expect_bcd(test, 0xffffffffULL, ledlock_bcd_from(0xffffffffULL));
+}
+
+// Counting up by increments must track a full conversion, through every
+//  carry up to six digits and across the top of each longer length.
+static void ledlock_test_bcd_inc(struct kunit *test) {
+    __u64 val, p, bcd = 0;
+
+    for (val = 1; val <= 1000000; ++val) {
+        bcd = ledlock_bcd_inc(bcd);
+        if (bcd != ledlock_bcd_from(val)) {
+            ledlock_expect_bcd(test, val, bcd);
+            return;
+        }
+    }
+    for (p = 10000000; p <= 1000000000000000ULL; p *= 10) {
+        bcd = ledlock_bcd_from(p - 2);
+        for (val = p - 1; val <= p + 1; ++val) {
+            bcd = ledlock_bcd_inc(bcd);
+            ledlock_expect_bcd(test, val, bcd);
+        }
+    }
+}
+
+// each way the engine moves the packed count on
+static void ledlock_test_bcd_advance(struct kunit *test) {
+    __u64 bcd = ledlock_bcd_from(199);
+
+    KUNIT_EXPECT_EQ(test, ledlock_bcd_advance(bcd, 199, 199), bcd);
+    ledlock_expect_bcd(test, 200, ledlock_bcd_advance(bcd, 199, 200));
+    ledlock_expect_bcd(test, 0, ledlock_bcd_advance(bcd, 199, 0));
+    ledlock_expect_bcd(test, 4321, ledlock_bcd_advance(bcd, 199, 4321));
+    ledlock_expect_bcd(test, 7, ledlock_bcd_advance(bcd, 199, 7));
+}
+
+
+//===========================================================================
+//  Count against the cap
+//===========================================================================
+
+// n whole seconds and a little, so truncation is exercised too
+#define SECS(n)     ((n) * LEDLOCK_NSEC_PER_SEC + LEDLOCK_NSEC_PER_SEC / 2)
+
+static void ledlock_test_count_wrap(struct kunit *test) {
+    KUNIT_EXPECT_EQ(test, ledlock_core_count(0, 10, true), 0ULL);
+    KUNIT_EXPECT_EQ(test, ledlock_core_count(SECS(9), 10, true), 9ULL);
+    KUNIT_EXPECT_EQ(test, ledlock_core_count(SECS(10), 10, true), 0ULL);
+    KUNIT_EXPECT_EQ(test, ledlock_core_count(SECS(25), 10, true), 5ULL);
+    KUNIT_EXPECT_EQ(test, ledlock_core_count(LEDLOCK_NSEC_PER_SEC - 1, 1,
+                                             true), 0ULL);
+    KUNIT_EXPECT_EQ(test, ledlock_core_count(SECS(12345), 1, true), 0ULL);
+    KUNIT_EXPECT_EQ(test, ledlock_core_count(SECS(1000000), 1000000, true),
+                    0ULL);
+    KUNIT_EXPECT_EQ(test, ledlock_core_count(U64_MAX, U64_MAX, true),
+                    U64_MAX / LEDLOCK_NSEC_PER_SEC);
+}
+
+static void ledlock_test_count_clamp(struct kunit *test) {
+    KUNIT_EXPECT_EQ(test, ledlock_core_count(0, 10, false), 0ULL);
+    KUNIT_EXPECT_EQ(test, ledlock_core_count(SECS(9), 10, false), 9ULL);
+    KUNIT_EXPECT_EQ(test, ledlock_core_count(SECS(10), 10, false), 10ULL);
+    KUNIT_EXPECT_EQ(test, ledlock_core_count(SECS(99999), 10, false), 10ULL);
+    KUNIT_EXPECT_EQ(test, ledlock_core_count(U64_MAX, U64_MAX, false),
+                    U64_MAX / LEDLOCK_NSEC_PER_SEC);
+}
+
+// a cap of 0, as before the first write, used to divide by zero with wrap on
+static void ledlock_test_count_cap0(struct kunit *test) {
+    KUNIT_EXPECT_EQ(test, ledlock_core_count(0, 0, true), 0ULL);
+    KUNIT_EXPECT_EQ(test, ledlock_core_count(SECS(42), 0, true), 0ULL);
+    KUNIT_EXPECT_EQ(test, ledlock_core_count(0, 0, false), 0ULL);
+    KUNIT_EXPECT_EQ(test, ledlock_core_count(SECS(42), 0, false), 0ULL);
+}
+
+
+//===========================================================================
+//  Pause accounting
+//===========================================================================
+
+// Plays a run of pauses through ledlock_core_pause() and
+//  ledlock_core_resume(), as the PON and POFF ioctls do for the count and
+//  for each timer session, checking each adds exactly its length to the
+//  total and the count stays frozen through it.
+static void ledlock_test_pause(struct kunit *test) {
+    static const struct { __u64 run, pause; } spells[] = {
+        { SECS(3), SECS(2) }, { 1, SECS(100) }, { SECS(0), 1 },
+        { LEDLOCK_NSEC_PER_SEC - 1, LEDLOCK_NSEC_PER_SEC + 1 },
+        { SECS(59), SECS(3600) },
+    };
+    __u64 write_ns = 12345, now = write_ns, pause_ns = 0, marker = 0;
+    __u64 counted = 0, paused = 0, rem;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(spells); ++i) {
+        now += spells[i].run;
+        counted += spells[i].run;
+        KUNIT_EXPECT_EQ(test, ledlock_core_elapsed(now, write_ns, pause_ns,
+                                                   marker, false), counted);
+
+        // frozen for as long as the pause lasts
+        ledlock_core_pause(now, &marker);
+        now += spells[i].pause;
+        KUNIT_EXPECT_EQ(test, ledlock_core_elapsed(now, write_ns, pause_ns,
+                                                   marker, true), counted);
+        KUNIT_EXPECT_EQ(test, ledlock_core_resume(now, &pause_ns, marker),
+                        spells[i].pause);
+        paused += spells[i].pause;
+        KUNIT_EXPECT_EQ(test, pause_ns, paused);
+        KUNIT_EXPECT_EQ(test, ledlock_core_elapsed(now, write_ns, pause_ns,
+                                                   marker, false), counted);
+    }
+    KUNIT_EXPECT_EQ(test, ledlock_core_count(counted, 1000, true),
+                    ledlock_core_div(counted, LEDLOCK_NSEC_PER_SEC, &rem));
+}
+
+// deadlines keep the phase of the write however late they are serviced
+static void ledlock_test_forward(struct kunit *test) {
+    __u64 s = LEDLOCK_NSEC_PER_SEC;
+
+    KUNIT_EXPECT_EQ(test, ledlock_core_forward(5 * s, 4 * s, s), 5 * s);
+    KUNIT_EXPECT_EQ(test, ledlock_core_forward(5 * s, 5 * s, s), 6 * s);
+    KUNIT_EXPECT_EQ(test, ledlock_core_forward(5 * s + 7, 9 * s, s),
+                    9 * s + 7);
+    KUNIT_EXPECT_EQ(test, ledlock_core_forward(5 * s + 7, 9 * s + 7, s),
+                    10 * s + 7);
+}
+
+
+//===========================================================================
+//  Rendering
+//===========================================================================
+
+static void ledlock_test_compile(struct kunit *test) {
+    struct ledlock_frame frames[LEDLOCK_MAX_FRAMES];
+    unsigned int len;
+
+    // most significant digit first, each followed by its gap
+    len = ledlock_core_compile(frames, ledlock_bcd_from(407), true,
+                               200, 50, 300);
+    KUNIT_ASSERT_EQ(test, len, 6U);
+    KUNIT_EXPECT_EQ(test, frames[0].segments, ledlock_glyphs[4]);
+    KUNIT_EXPECT_EQ(test, frames[2].segments, ledlock_glyphs[0]);
+    KUNIT_EXPECT_EQ(test, frames[4].segments, ledlock_glyphs[7]);
+    KUNIT_EXPECT_EQ(test, frames[0].duration, 200U);
+    KUNIT_EXPECT_EQ(test, frames[1].duration, 50U);
+    KUNIT_EXPECT_EQ(test, frames[3].duration, 50U);
+    KUNIT_EXPECT_EQ(test, frames[5].duration, 300U);
+    KUNIT_EXPECT_EQ(test, frames[1].segments, 0);
+    KUNIT_EXPECT_TRUE(test, frames[0].latch && frames[1].latch);
+
+    // without wrap the digit stays latched through its gap
+    len = ledlock_core_compile(frames, ledlock_bcd_from(7), false,
+                               200, 50, 300);
+    KUNIT_ASSERT_EQ(test, len, 2U);
+    KUNIT_EXPECT_TRUE(test, frames[0].latch);
+    KUNIT_EXPECT_FALSE(test, frames[1].latch);
+
+    // a full word of digits fills the program exactly
+    len = ledlock_core_compile(frames, ledlock_bcd_from(9999999999999999ULL),
+                               true, 1, 1, 1);
+    KUNIT_EXPECT_EQ(test, len, (unsigned int)LEDLOCK_MAX_FRAMES);
+
+    // a nibble that is not a digit stops the program there
+    len = ledlock_core_compile(frames, 0x12a4, true, 1, 1, 1);
+    KUNIT_EXPECT_EQ(test, len, 4U);
+}
+
+
+//===========================================================================
+//  Engine
+//===========================================================================
+
+// a port for the engine to play to, remembering the last byte latched
+struct ledlock_test_port {
+    char latched;
+    unsigned int latches, pauses;
+    bool paused;
+};
+
+static void ledlock_test_latch(void *ctx, char segments) {
+    struct ledlock_test_port *port = ctx;
+
+    port->latched = segments;
+    ++port->latches;
+}
+
+static void ledlock_test_frame(void *ctx, char segments,
+                               unsigned int duration)
+{
+}
+
+static void ledlock_test_trace(void *ctx, bool paused) {
+    struct ledlock_test_port *port = ctx;
+
+    port->paused = paused;
+    ++port->pauses;
+}
+
+static void ledlock_test_yield(void *ctx) {
+}
+
+static void ledlock_test_load(void *ctx) {
+}
+
+static unsigned int ledlock_test_park(void *ctx) {
+    return LEDLOCK_IDLE;
+}
+
+static const struct ledlock_core_ops ledlock_test_ops = {
+    .latch  = ledlock_test_latch,
+    .frame  = ledlock_test_frame,
+    .pause  = ledlock_test_trace,
+    .yield  = ledlock_test_yield,
+    .load   = ledlock_test_load,
+    .park   = ledlock_test_park,
+};
+
+// A pause cutting into a sequence holds the digit on show and parks, and
+//  unpausing picks up with the frame it cut short.
+static void ledlock_test_step_pause(struct kunit *test) {
+    struct ledlock_core_engine eng = { .phase = LEDLOCK_PHASE_WAIT };
+    struct ledlock_test_port port = { 0 };
+
+    eng.program_len = ledlock_core_compile(eng.program, ledlock_bcd_from(407),
+                                           true, 200, 50, 300);
+
+    KUNIT_EXPECT_EQ(test, ledlock_core_step(&eng, &ledlock_test_ops, &port,
+                                            true, false, true), 200U);
+    KUNIT_EXPECT_EQ(test, port.latched, ledlock_glyphs[4]);
+    KUNIT_EXPECT_TRUE(test, eng.shown);
+    KUNIT_EXPECT_EQ(test, ledlock_core_step(&eng, &ledlock_test_ops, &port,
+                                            true, false, true), 50U);
+    KUNIT_EXPECT_EQ(test, port.latched, 0);
+
+    // paused in the gap: the last digit goes back up and the engine parks
+    KUNIT_EXPECT_EQ(test, ledlock_core_preempt(&eng, &ledlock_test_ops,
+                                               &port, true, true, false),
+                    LEDLOCK_IDLE);
+    KUNIT_EXPECT_EQ(test, eng.phase, LEDLOCK_PHASE_PAUSED);
+    KUNIT_EXPECT_EQ(test, port.latched, ledlock_glyphs[4]);
+    KUNIT_EXPECT_TRUE(test, port.paused);
+
+    // kicked while still paused it parks again, without another trace
+    KUNIT_EXPECT_EQ(test, ledlock_core_step(&eng, &ledlock_test_ops, &port,
+                                            true, true, true), LEDLOCK_IDLE);
+    KUNIT_EXPECT_EQ(test, port.pauses, 1U);
+
+    // unpaused, the gap is played again in full, then the next digit
+    KUNIT_EXPECT_EQ(test, ledlock_core_step(&eng, &ledlock_test_ops, &port,
+                                            true, false, true), 50U);
+    KUNIT_EXPECT_FALSE(test, port.paused);
+    KUNIT_EXPECT_EQ(test, ledlock_core_step(&eng, &ledlock_test_ops, &port,
+                                            true, false, true), 200U);
+    KUNIT_EXPECT_EQ(test, port.latched, ledlock_glyphs[0]);
+
+    // a command undone before the engine got to it needs nothing doing
+    KUNIT_EXPECT_EQ(test, ledlock_core_preempt(&eng, &ledlock_test_ops,
+                                               &port, false, true, false),
+                    LEDLOCK_RESUME);
+}
+
+
+//===========================================================================
+//  Benchmarks
+//===========================================================================
+
+// Times the per-second render path: bringing the digits up to date and
+//  compiling the frames, for a steady count, after a skip and for the
+//  divide-per-digit conversion the increment replaced.
+static void ledlock_bench_render(struct kunit *test) {
+    struct ledlock_frame frames[LEDLOCK_MAX_FRAMES];
+    __u64 val, bcd = 0, start, inc_ns, from_ns, compile_ns;
+
+    start = ktime_get_ns();
+    for (val = 1; val <= LEDLOCK_BENCH_ROUNDS; ++val)
+        bcd = ledlock_bcd_advance(bcd, val - 1, val);
+    inc_ns = ktime_get_ns() - start;
+    ledlock_sink = bcd;
+    ledlock_expect_bcd(test, LEDLOCK_BENCH_ROUNDS, bcd);
+
+    start = ktime_get_ns();
+    for (val = 1; val <= LEDLOCK_BENCH_ROUNDS; ++val)
+        bcd = ledlock_bcd_advance(bcd, 0, val * 7);
+    from_ns = ktime_get_ns() - start;
+    ledlock_sink = bcd;
+
+    start = ktime_get_ns();
+    for (val = 1; val <= LEDLOCK_BENCH_ROUNDS; ++val)
+        ledlock_sink += ledlock_core_compile(frames, bcd + (val & 1), true,
+                                             200, 50, 200);
+    compile_ns = ktime_get_ns() - start;
+
+    kunit_info(test, "per value: %llu ns incremented, %llu ns converted, "
+               "%llu ns compiled (%u rounds)\n",
+               div_u64(inc_ns, LEDLOCK_BENCH_ROUNDS),
+               div_u64(from_ns, LEDLOCK_BENCH_ROUNDS),
+               div_u64(compile_ns, LEDLOCK_BENCH_ROUNDS), LEDLOCK_BENCH_ROUNDS);
+}
+
+// Times the count itself, read on every frame and by every reader, wrapped
+//  and clamped.
+static void ledlock_bench_count(struct kunit *test) {
+    __u64 i, start, wrap_ns, clamp_ns;
+
+    start = ktime_get_ns();
+    for (i = 0; i < LEDLOCK_BENCH_ROUNDS; ++i)
+        ledlock_sink += ledlock_core_count(i * 999999937ULL, 1000000, true);
+    wrap_ns = ktime_get_ns() - start;
+
+    start = ktime_get_ns();
+    for (i = 0; i < LEDLOCK_BENCH_ROUNDS; ++i)
+        ledlock_sink += ledlock_core_count(i * 999999937ULL, 1000000, false);
+    clamp_ns = ktime_get_ns() - start;
+
+    kunit_info(test, "per count: %llu ns wrapped, %llu ns clamped\n",
+               div_u64(wrap_ns, LEDLOCK_BENCH_ROUNDS),
+               div_u64(clamp_ns, LEDLOCK_BENCH_ROUNDS));
+}
+
+
+static struct kunit_case ledlock_test_cases[] = {
+    KUNIT_CASE(ledlock_test_bcd_from),
+    KUNIT_CASE(ledlock_test_bcd_inc),
+    KUNIT_CASE(ledlock_test_bcd_advance),
+    KUNIT_CASE(ledlock_test_count_wrap),
+    KUNIT_CASE(ledlock_test_count_clamp),
+    KUNIT_CASE(ledlock_test_count_cap0),
+    KUNIT_CASE(ledlock_test_pause),
+    KUNIT_CASE(ledlock_test_forward),
+    KUNIT_CASE(ledlock_test_compile),
+    KUNIT_CASE(ledlock_test_step_pause),
+    KUNIT_CASE_SLOW(ledlock_bench_render),
+    KUNIT_CASE_SLOW(ledlock_bench_count),
+    {}
+};
+
+static struct kunit_suite ledlock_test_suite = {
+    .name       = "ledlock",
+    .test_cases = ledlock_test_cases,
+};
+kunit_test_suite(ledlock_test_suite);
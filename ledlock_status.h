@@ -0,0 +1,68 @@
+/*  Code by Preston Hamlin
+Userspace reader for the ledlock status page. Map the page once with
+    ledlock_status_map(), then sample it as often as needed without making
+    any system calls:
+
+        const struct ledlock_status *page = ledlock_status_map(fd);
+        struct ledlock_status snap;
+
+        ledlock_status_read(page, &snap);
+        printf("%llu\n", ledlock_status_count(&snap));
+
+See ledlock.h for the layout of the page.
+*/
+
+#ifndef LEDLOCK_STATUS_H
+#define LEDLOCK_STATUS_H
+
+#include "ledlock.h"
+#include "ledlock_core.h"
+
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+
+// maps the status page of an open ledlock device, NULL on failure
+static inline const struct ledlock_status *ledlock_status_map(int fd) {
+    void *page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED,
+                      fd, 0);
+
+    return page == MAP_FAILED ? NULL : (const struct ledlock_status *)page;
+}
+
+// Takes a consistent snapshot of the page, retrying while the kernel is
+//  updating it.
+static inline void ledlock_status_read(const struct ledlock_status *page,
+                                       struct ledlock_status *snap)
+{
+    __u32 seq;
+
+    do {
+        while ((seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE)) & 1)
+            ;
+        *snap = *page;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) != seq);
+}
+
+// Works the count out as of now from a snapshot with the driver's own
+//  ledlock_core_count(), so it stays correct between updates of the page
+//  and always agrees with read().
+static inline unsigned long long
+ledlock_status_count(const struct ledlock_status *snap)
+{
+    struct timespec ts;
+    __u64 now;
+
+    if (!(snap->flags & LEDLOCK_STATUS_WRITTEN)) return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = ts.tv_sec * LEDLOCK_NSEC_PER_SEC + ts.tv_nsec;
+    return ledlock_core_count(ledlock_core_elapsed(now, snap->write_ns,
+                                  snap->pause_ns, snap->pause_start_ns,
+                                  snap->flags & LEDLOCK_STATUS_PAUSED),
+                              snap->cap, snap->flags & LEDLOCK_STATUS_WRAP);
+}
+
+#endif
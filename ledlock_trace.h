@@ -0,0 +1,180 @@
+/*  Code by Preston Hamlin
+Tracepoints for the ledlock display engine. Every event carries the time it
+    was meant to happen and the time it actually did, both in ns on the
+    monotonic clock, so timing can be studied from the trace alone:
+
+    echo 1 > /sys/kernel/tracing/events/ledlock/enable
+    tests/traceanalyze < /sys/kernel/tracing/trace_pipe
+
+Included twice by ledlock.c, the second time with CREATE_TRACE_POINTS
+    defined, so it must not be guarded in the usual way.
+*/
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ledlock
+
+#if !defined(LEDLOCK_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define LEDLOCK_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// A frame put on the port, by the display engine or the frame stream. The
+//  frame is intended to start at intended and to last dwell_us. Blanking
+//  the display shows up as an empty frame of no length.
+TRACE_EVENT(ledlock_frame,
+
+    TP_PROTO(int minor, u8 segments, unsigned int dwell_us, u64 intended,
+             u64 actual),
+
+    TP_ARGS(minor, segments, dwell_us, intended, actual),
+
+    TP_STRUCT__entry(
+        __field(int,            minor)
+        __field(u8,             segments)
+        __field(unsigned int,   dwell_us)
+        __field(u64,            intended)
+        __field(u64,            actual)
+    ),
+
+    TP_fast_assign(
+        __entry->minor    = minor;
+        __entry->segments = segments;
+        __entry->dwell_us = dwell_us;
+        __entry->intended = intended;
+        __entry->actual   = actual;
+    ),
+
+    TP_printk("minor=%d segments=0x%02x dwell_us=%u intended=%llu actual=%llu",
+              __entry->minor, __entry->segments, __entry->dwell_us,
+              __entry->intended, __entry->actual)
+);
+
+// The count moved on to seconds, intended being the second boundary.
+TRACE_EVENT(ledlock_tick,
+
+    TP_PROTO(int minor, u64 seconds, u64 intended, u64 actual),
+
+    TP_ARGS(minor, seconds, intended, actual),
+
+    TP_STRUCT__entry(
+        __field(int,    minor)
+        __field(u64,    seconds)
+        __field(u64,    intended)
+        __field(u64,    actual)
+    ),
+
+    TP_fast_assign(
+        __entry->minor    = minor;
+        __entry->seconds  = seconds;
+        __entry->intended = intended;
+        __entry->actual   = actual;
+    ),
+
+    TP_printk("minor=%d seconds=%llu intended=%llu actual=%llu",
+              __entry->minor, __entry->seconds, __entry->intended,
+              __entry->actual)
+);
+
+// The display engine froze on, or moved on from, a pause. intended is when
+//  the engine was woken to do so, by the command or the unpausing kick.
+TRACE_EVENT(ledlock_pause,
+
+    TP_PROTO(int minor, bool paused, u64 intended, u64 actual),
+
+    TP_ARGS(minor, paused, intended, actual),
+
+    TP_STRUCT__entry(
+        __field(int,    minor)
+        __field(bool,   paused)
+        __field(u64,    intended)
+        __field(u64,    actual)
+    ),
+
+    TP_fast_assign(
+        __entry->minor    = minor;
+        __entry->paused   = paused;
+        __entry->intended = intended;
+        __entry->actual   = actual;
+    ),
+
+    TP_printk("minor=%d paused=%d intended=%llu actual=%llu",
+              __entry->minor, __entry->paused, __entry->intended,
+              __entry->actual)
+);
+
+// A new counter cap, intended being when write() was entered and actual the
+//  instant the count is measured from.
+TRACE_EVENT(ledlock_write,
+
+    TP_PROTO(int minor, u64 cap, u64 intended, u64 actual),
+
+    TP_ARGS(minor, cap, intended, actual),
+
+    TP_STRUCT__entry(
+        __field(int,    minor)
+        __field(u64,    cap)
+        __field(u64,    intended)
+        __field(u64,    actual)
+    ),
+
+    TP_fast_assign(
+        __entry->minor    = minor;
+        __entry->cap      = cap;
+        __entry->intended = intended;
+        __entry->actual   = actual;
+    ),
+
+    TP_printk("minor=%d cap=%llu intended=%llu actual=%llu",
+              __entry->minor, __entry->cap, __entry->intended,
+              __entry->actual)
+);
+
+// A control ioctl, with the settings as they stand afterwards in
+//  LEDLOCK_STATUS_* flags and ms. intended is when the ioctl was entered,
+//  actual when it had been applied.
+TRACE_EVENT(ledlock_config,
+
+    TP_PROTO(int minor, unsigned int cmd, unsigned int flags,
+             unsigned int time_display, unsigned int time_blank_digit,
+             unsigned int time_blank_value, u64 intended, u64 actual),
+
+    TP_ARGS(minor, cmd, flags, time_display, time_blank_digit,
+            time_blank_value, intended, actual),
+
+    TP_STRUCT__entry(
+        __field(int,            minor)
+        __field(unsigned int,   cmd)
+        __field(unsigned int,   flags)
+        __field(unsigned int,   time_display)
+        __field(unsigned int,   time_blank_digit)
+        __field(unsigned int,   time_blank_value)
+        __field(u64,            intended)
+        __field(u64,            actual)
+    ),
+
+    TP_fast_assign(
+        __entry->minor            = minor;
+        __entry->cmd              = cmd;
+        __entry->flags            = flags;
+        __entry->time_display     = time_display;
+        __entry->time_blank_digit = time_blank_digit;
+        __entry->time_blank_value = time_blank_value;
+        __entry->intended         = intended;
+        __entry->actual           = actual;
+    ),
+
+    TP_printk("minor=%d cmd=%u flags=0x%x display=%u blank_digit=%u "
+              "blank_value=%u intended=%llu actual=%llu",
+              __entry->minor, __entry->cmd, __entry->flags,
+              __entry->time_display, __entry->time_blank_digit,
+              __entry->time_blank_value, __entry->intended, __entry->actual)
+);
+
+#endif // LEDLOCK_TRACE_H
+
+// the header lives with the module rather than in include/trace/events
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ledlock_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,107 @@
+// microbenchmark of the display engine's digit paths: the itoa() conversion
+//  it used to run every second, a full conversion to packed BCD, and the
+//  in-place BCD increment it now uses, each over the whole 32 bit range
+//  (or the first N values, given N as an argument)
+//
+// itoa() is the Free Software Foundation's GPLv2 version, as the driver used,
+//  plus a 'u' base so the whole range converts unsigned like the BCD paths
+
+#include "ledlock_bcd.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+// results land here so the loops are not optimized away
+volatile __u64 sink;
+
+/* Convert the integer D to a string and save the string in BUF. If
+        BASE is equal to 'd', interpret that D is decimal, if BASE is
+        equal to 'u', unsigned decimal, and if BASE is equal to 'x',
+        interpret that D is hexadecimal. */
+void itoa (char *buf, int base, int d) {
+    char *p = buf;
+    char *p1, *p2;
+    unsigned long ud = (base == 'u') ? (unsigned int)d : d;
+    int divisor = 10;
+
+    /* If %d is specified and D is minus, put `-' in the head. */
+    if (base == 'd' && d < 0)
+        {
+            *p++ = '-';
+            buf++;
+            ud = -d;
+        }
+    else if (base == 'x')
+        divisor = 16;
+
+    /* Divide UD by DIVISOR until UD == 0. */
+    do {
+        int remainder = ud % divisor;
+
+        *p++ = (remainder < 10) ? remainder + '0' : remainder + 'a' - 10;
+    } while (ud /= divisor);
+
+    /* Terminate BUF. */
+    *p = 0;
+
+    /* Reverse BUF. */
+    p1 = buf;
+    p2 = p - 1;
+    while (p1 < p2) {
+        char tmp = *p1;
+        *p1 = *p2;
+        *p2 = tmp;
+        p1++;
+        p2--;
+    }
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    unsigned long long n = argc > 1 ? strtoull(argv[1], NULL, 0) : 1ULL << 32;
+    unsigned long long i;
+
+    __u64 bcd = 0;
+    char buf[12];
+    double start, t_itoa, t_from, t_inc;
+
+    start = now();
+    for (i = 0; i < n; ++i) {
+        itoa(buf, 'u', (int)i);
+        sink = buf[0];
+    }
+    t_itoa = now() - start;
+
+    start = now();
+    for (i = 0; i < n; ++i) sink = ledlock_bcd_from(i);
+    t_from = now() - start;
+
+    // the engine's usual path, checked against a full conversion now and then
+    start = now();
+    for (i = 0; i < n; ++i) {
+        if (i % 1000003 == 0 && bcd != ledlock_bcd_from(i)) {
+            fprintf (stderr, "bcdbench: increment wrong at %llu\n", i);
+            return -1;
+        }
+        bcd = ledlock_bcd_inc(bcd);
+    }
+    sink = bcd;
+    t_inc = now() - start;
+
+    fprintf (stdout, "%llu values\n", n);
+    fprintf (stdout, "itoa      %8.3f s  %6.2f ns/value\n",
+             t_itoa, t_itoa * 1e9 / n);
+    fprintf (stdout, "bcd_from  %8.3f s  %6.2f ns/value\n",
+             t_from, t_from * 1e9 / n);
+    fprintf (stdout, "bcd_inc   %8.3f s  %6.2f ns/value\n",
+             t_inc, t_inc * 1e9 / n);
+
+    return 0;
+}
@@ -0,0 +1,337 @@
+// concurrency benchmark (load with backend=sim, or run "make benchsim"):
+//  opens /dev/ledlock0 from a number of threads, or processes, which all
+//  hammer it with a weighted mix of read(), write() and the ioctls, the way
+//  monitoring agents and control scripts do at once. Reports ops/s and
+//  p50/p99/p999 latency for each operation, and how far the display's
+//  timing strayed meanwhile, from the writes the simulated port recorded.
+//
+//      bench [-t workers] [-P] [-s seconds] [-m op=weight,...]
+//
+//  -P runs the workers as processes rather than threads. Operations are
+//  read, read64, write, pon, poff, don, doff, won, woff, show, blankd,
+//  blankv, setcfg, getcfg and events; the default mix is mostly reads with
+//  some control traffic. Run it before and after a locking change.
+
+#include "ledlock.h"
+#include "ledlock_test.h"
+
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define DEBUGFS "/sys/kernel/debug/ledlock/ledlock0/"
+
+// timings the display runs with, restored by every timing operation
+#define TIME_DISPLAY    100
+#define TIME_BLANK      50
+
+enum {
+    OP_READ, OP_READ64, OP_WRITE, OP_PON, OP_POFF, OP_DON, OP_DOFF, OP_WON,
+    OP_WOFF, OP_SHOW, OP_BLANKD, OP_BLANKV, OP_SETCFG, OP_GETCFG, OP_EVENTS,
+    OPS
+};
+
+static const char *op_names[OPS] = {
+    "read", "read64", "write", "pon", "poff", "don", "doff", "won",
+    "woff", "show", "blankd", "blankv", "setcfg", "getcfg", "events",
+};
+
+static const char *default_mix = "read=50,read64=10,getcfg=10,events=5,"
+    "write=5,pon=3,poff=3,won=2,woff=2,don=1,doff=1,setcfg=4,show=2,"
+    "blankd=1,blankv=1";
+
+// Latencies are kept in log-linear buckets, 32 to each power of two, so
+//  percentiles come out within a few per cent without keeping samples.
+#define SUB_BITS    5
+#define BUCKETS     (64 << SUB_BITS)
+
+struct hist {
+    unsigned long long count, max;
+    unsigned long long bucket[BUCKETS];
+};
+
+// one per worker, in memory shared with the parent
+struct worker {
+    struct hist ops[OPS];
+    int errors;
+};
+
+static int weights[OPS], total_weight;
+static int seconds = 10;
+static struct worker *workers;
+static volatile int *stop;
+
+static int bucket_of(unsigned long long ns) {
+    int msb;
+
+    if (ns < (1 << SUB_BITS)) return ns;
+    msb = 63 - __builtin_clzll(ns);
+    return ((msb - SUB_BITS + 1) << SUB_BITS) +
+           ((ns >> (msb - SUB_BITS)) & ((1 << SUB_BITS) - 1));
+}
+
+// lowest value that lands in a bucket
+static unsigned long long bucket_floor(int b) {
+    int shift = (b >> SUB_BITS) - 1;
+
+    if (shift < 0) return b;
+    return ((1ULL << SUB_BITS) | (b & ((1 << SUB_BITS) - 1))) << shift;
+}
+
+static void hist_add(struct hist *h, unsigned long long ns) {
+    ++h->count;
+    ++h->bucket[bucket_of(ns)];
+    if (ns > h->max) h->max = ns;
+}
+
+static void hist_merge(struct hist *to, const struct hist *from) {
+    int b;
+
+    to->count += from->count;
+    if (from->max > to->max) to->max = from->max;
+    for (b = 0; b < BUCKETS; ++b) to->bucket[b] += from->bucket[b];
+}
+
+static unsigned long long hist_pct(const struct hist *h, double pct) {
+    unsigned long long want = h->count * pct / 100.0, seen = 0;
+    int b;
+
+    for (b = 0; b < BUCKETS; ++b) {
+        seen += h->bucket[b];
+        if (seen > want) return bucket_floor(b);
+    }
+    return h->max;
+}
+
+// Reads an op=weight list into the weights.
+static int parse_mix(const char *mix) {
+    char buf[512], *tok, *save, *eq;
+    int op;
+
+    memset(weights, 0, sizeof(weights));
+    total_weight = 0;
+    snprintf(buf, sizeof(buf), "%s", mix);
+    for (tok = strtok_r(buf, ",", &save); tok;
+         tok = strtok_r(NULL, ",", &save)) {
+        if (!(eq = strchr(tok, '='))) return -1;
+        *eq = 0;
+        for (op = 0; op < OPS && strcmp(op_names[op], tok); ++op)
+            ;
+        if (op == OPS) return -1;
+        weights[op] = atoi(eq + 1);
+        total_weight += weights[op];
+    }
+    return total_weight > 0 ? 0 : -1;
+}
+
+// Runs one operation, returning whether it failed.
+static int do_op(int fd, int op) {
+    unsigned int val32 = 1000000, events;
+    unsigned long long val64;
+    struct ledlock_config cfg;
+
+    switch (op) {
+        case OP_READ:   return read (fd, &val32, sizeof(val32)) < 0;
+        case OP_READ64: return read (fd, &val64, sizeof(val64)) < 0;
+        case OP_WRITE:  return write (fd, &val32, sizeof(val32)) < 0;
+        case OP_PON:    return ioctl(fd, IOCTL_LEDLOCK_PON) < 0;
+        case OP_POFF:   return ioctl(fd, IOCTL_LEDLOCK_POFF) < 0;
+        case OP_DON:    return ioctl(fd, IOCTL_LEDLOCK_DON) < 0;
+        case OP_DOFF:   return ioctl(fd, IOCTL_LEDLOCK_DOFF) < 0;
+        case OP_WON:    return ioctl(fd, IOCTL_LEDLOCK_WON) < 0;
+        case OP_WOFF:   return ioctl(fd, IOCTL_LEDLOCK_WOFF) < 0;
+        case OP_SHOW:
+            return ioctl(fd, IOCTL_LEDLOCK_SHOW, TIME_DISPLAY) < 0;
+        case OP_BLANKD:
+            return ioctl(fd, IOCTL_LEDLOCK_BLANK_DIGIT, TIME_BLANK) < 0;
+        case OP_BLANKV:
+            return ioctl(fd, IOCTL_LEDLOCK_BLANK_VALUE, TIME_BLANK) < 0;
+        case OP_SETCFG:
+            memset(&cfg, 0, sizeof(cfg));
+            cfg.mask             = LEDLOCK_CFG_TIME_DISPLAY |
+                                   LEDLOCK_CFG_BLANK_DIGIT |
+                                   LEDLOCK_CFG_BLANK_VALUE;
+            cfg.time_display     = TIME_DISPLAY;
+            cfg.time_blank_digit = TIME_BLANK;
+            cfg.time_blank_value = TIME_BLANK;
+            return ioctl(fd, IOCTL_LEDLOCK_SET_CONFIG, &cfg) < 0;
+        case OP_GETCFG: return ioctl(fd, IOCTL_LEDLOCK_GET_CONFIG, &cfg) < 0;
+        case OP_EVENTS: return ioctl(fd, IOCTL_LEDLOCK_EVENTS, &events) < 0;
+    }
+    return 1;
+}
+
+// Worker body: its own open file, picking operations at random by weight
+//  until told to stop.
+static void *work(void *arg) {
+    struct worker *w = arg;
+    unsigned int seed = (w - workers) * 2654435761U + 1;
+    unsigned long long start;
+    int fd, op, pick;
+
+    if ((fd = open ("/dev/ledlock0", O_RDWR)) == -1) {
+        perror("bench opening file");
+        w->errors = -1;
+        return NULL;
+    }
+    while (!*stop) {
+        pick = rand_r(&seed) % total_weight;
+        for (op = 0; pick >= weights[op]; ++op) pick -= weights[op];
+
+        start = now_ns();
+        w->errors += do_op(fd, op);
+        hist_add(&w->ops[op], now_ns() - start);
+    }
+    close(fd);
+    return NULL;
+}
+
+// Drains the simulated port while the workers run, measuring how much longer
+//  than TIME_DISPLAY each digit stayed up before its gap blanked it. Digits
+//  cut short by a command are counted apart, as they are meant to be.
+static void watch(int sim, struct hist *late, unsigned long long *cut) {
+    struct ledlock_sim_record recs[64], prev = { 0 };
+    unsigned long long end = now_ns() + seconds * 1000000000ULL, held;
+    int i, n;
+
+    while (now_ns() < end) {
+        n = read (sim, recs, sizeof(recs)) / (int)sizeof(recs[0]);
+        if (n <= 0) {
+            usleep(10000);
+            continue;
+        }
+        for (i = 0; i < n; ++i) {
+            if (prev.segments && !recs[i].segments) {
+                held = recs[i].time_ns - prev.time_ns;
+                if (held < TIME_DISPLAY * 1000000ULL) ++*cut;
+                else hist_add(late, held - TIME_DISPLAY * 1000000ULL);
+            }
+            prev = recs[i];
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    int n = 4, procs = 0, fd, sim, st, i, op, opt, errors = 0;
+    unsigned int cap = 1000000;
+    unsigned long long cut = 0, total = 0, dropped;
+    struct ledlock_config cfg;
+    struct ledlock_sim_record recs[64];
+    struct hist sum, late;
+    pthread_t *threads;
+    const char *mix = default_mix;
+
+    while ((opt = getopt(argc, argv, "t:Ps:m:")) != -1) {
+        switch (opt) {
+            case 't': n       = atoi(optarg); break;
+            case 'P': procs   = 1;            break;
+            case 's': seconds = atoi(optarg); break;
+            case 'm': mix     = optarg;       break;
+            default:
+                fprintf (stderr, "bench: see the top of bench.c\n");
+                return -1;
+        }
+    }
+    if (n < 1 || parse_mix(mix)) {
+        fprintf (stderr, "bench: bad worker count or mix\n");
+        return -1;
+    }
+
+    if ((fd = open ("/dev/ledlock0", O_RDWR)) == -1) {
+        perror("bench opening file");
+        return -1;
+    }
+    if ((sim = open (DEBUGFS "sim", O_RDONLY | O_NONBLOCK)) == -1) {
+        perror("bench opening sim (load with backend=sim)");
+        return -1;
+    }
+
+    // a known start: counting, wrapping, shown, the bench's timings
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.mask             = LEDLOCK_CFG_ALL;
+    cfg.flags            = LEDLOCK_STATUS_WRAP | LEDLOCK_STATUS_DISPLAY;
+    cfg.time_display     = TIME_DISPLAY;
+    cfg.time_blank_digit = TIME_BLANK;
+    cfg.time_blank_value = TIME_BLANK;
+    ioctl(fd, IOCTL_LEDLOCK_SET_CONFIG, &cfg);
+    write (fd, &cap, sizeof(cap));
+    if ((st = open (DEBUGFS "stats", O_WRONLY)) != -1) {
+        write (st, "1", 1);
+        close(st);
+    }
+    while (read (sim, recs, sizeof(recs)) > 0)
+        ;
+    dropped = counter(DEBUGFS "sim_dropped", NULL);
+
+    workers = mmap(NULL, n * sizeof(*workers) + sizeof(*stop),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (workers == MAP_FAILED) {
+        perror("bench mapping results");
+        return -1;
+    }
+    stop = (volatile int *)(workers + n);
+    threads = calloc(n, sizeof(*threads));
+
+    for (i = 0; i < n; ++i) {
+        if (!procs) pthread_create(&threads[i], NULL, work, &workers[i]);
+        else if (!fork()) {
+            work(&workers[i]);
+            _exit(0);
+        }
+    }
+
+    memset(&late, 0, sizeof(late));
+    watch(sim, &late, &cut);
+    *stop = 1;
+    for (i = 0; i < n; ++i) {
+        if (!procs) pthread_join(threads[i], NULL);
+        else wait(NULL);
+    }
+    ioctl(fd, IOCTL_LEDLOCK_POFF);
+    ioctl(fd, IOCTL_LEDLOCK_DON);
+    ioctl(fd, IOCTL_LEDLOCK_WON);
+
+    fprintf (stdout, "%d %s, %d s, mix %s\n\n", n, procs ? "processes" :
+             "threads", seconds, mix);
+    fprintf (stdout, "%-8s %10s %12s %10s %10s %10s %10s\n", "op", "ops",
+             "ops/s", "p50 us", "p99 us", "p999 us", "max us");
+    for (op = 0; op < OPS; ++op) {
+        memset(&sum, 0, sizeof(sum));
+        for (i = 0; i < n; ++i) hist_merge(&sum, &workers[i].ops[op]);
+        total += sum.count;
+        if (!sum.count) continue;
+        fprintf (stdout, "%-8s %10llu %12.0f %10.2f %10.2f %10.2f %10.2f\n",
+                 op_names[op], sum.count, (double)sum.count / seconds,
+                 hist_pct(&sum, 50) / 1e3, hist_pct(&sum, 99) / 1e3,
+                 hist_pct(&sum, 99.9) / 1e3, sum.max / 1e3);
+    }
+    for (i = 0; i < n; ++i) errors += workers[i].errors;
+    fprintf (stdout, "%-8s %10llu %12.0f   (%d errors)\n\n", "all", total,
+             (double)total / seconds, errors);
+
+    fprintf (stdout, "digit dwell over %d ms: %llu digits, p50 %.3f ms, "
+             "p99 %.3f ms, p999 %.3f ms, max %.3f ms; %llu cut short\n",
+             TIME_DISPLAY, late.count, hist_pct(&late, 50) / 1e6,
+             hist_pct(&late, 99) / 1e6, hist_pct(&late, 99.9) / 1e6,
+             late.max / 1e6, cut);
+    fprintf (stdout, "engine: %llu deadline misses, worst %llu ns over, "
+             "%llu seconds skipped, %llu sim records dropped\n",
+             counter(DEBUGFS "stats", "deadline_misses"),
+             counter(DEBUGFS "stats", "worst_overshoot_ns"),
+             counter(DEBUGFS "stats", "skipped_seconds"),
+             counter(DEBUGFS "sim_dropped", NULL) - dropped);
+    fprintf (stdout, "locking: %llu reader retries, %llu writer waits\n",
+             counter(DEBUGFS "stats", "seq_retries"),
+             counter(DEBUGFS "stats", "mutex_waits"));
+
+    close(sim);
+    close(fd);
+    return errors ? 1 : 0;
+}
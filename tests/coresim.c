@@ -0,0 +1,338 @@
+// simulator which runs the display engine's core, as compiled into the
+//  module, against a virtual clock and a fake port, so a day of operation
+//  takes well under a second. The engine is stepped and paused through the
+//  same ledlock_core.h functions the module's timer and ioctls call. Each
+//  digit sequence is read back off the fake port and checked against the
+//  count it should show, and any number never shown is counted as skipped.
+//
+//      coresim [-d display] [-b blank_digit] [-v blank_value] [-c cap]
+//              [-n] [-s seconds] [-p every:length] [-l latency_us]
+//      coresim -S
+//
+//  Times are in ms as for the module, -n turns wrap off, -p pauses the count
+//  for length seconds every so many seconds, wherever that falls in a
+//  sequence, and -l makes every timer fire that late. -S sweeps timings against caps of 1 to 6 digits and reports
+//  the longest display time that never skips for each.
+
+#include "ledlock_core.h"
+
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define MS  1000000ULL
+
+struct sim {
+    // settings
+    unsigned int time_display, time_blank_digit, time_blank_value;
+    __u64 cap;
+    bool wrap;
+    __u64 seconds;
+    __u64 pause_every, pause_length;    // in s, 0 for no pauses
+    __u64 latency;                      // ns
+
+    // results
+    __u64 values, skipped, wrong, writes, first_skip;
+
+    // the count, as the module keeps it
+    __u64 now, write_ns, pause_ns, pause_marker;
+    bool paused;
+
+    // the engine and its timer, as ledlock_timer_fn() drives them
+    struct ledlock_core_engine eng;
+    __u64 expires, due;
+    bool running, poked;
+
+    // the sequence being played and the count it should read back as
+    __u64 count;
+    char digits[LEDLOCK_BCD_DIGITS + 1];
+};
+
+// Checks that the sequence just played read back off the port as the count
+//  it was compiled from.
+static void check_sequence(struct sim *s) {
+    char shown[32];
+
+    snprintf(shown, sizeof(shown), "%llu", (unsigned long long)s->count);
+    if (strcmp(shown, s->digits)) ++s->wrong;
+}
+
+// The fake port, counting each byte latched.
+static void sim_latch(void *ctx, char segments) {
+    struct sim *s = ctx;
+
+    ++s->writes;
+}
+
+// Reads each digit frame back as a digit. One cut short by a pause is played
+//  again in full on unpause, so digits are kept by their place in the
+//  program rather than appended.
+static void sim_frame(void *ctx, char segments, unsigned int duration) {
+    static const char glyphs[10] = {
+        L_DIGIT_0, L_DIGIT_1, L_DIGIT_2, L_DIGIT_3, L_DIGIT_4,
+        L_DIGIT_5, L_DIGIT_6, L_DIGIT_7, L_DIGIT_8, L_DIGIT_9,
+    };
+    struct sim *s = ctx;
+    unsigned int at = s->eng.frame_index / 2;
+    int d;
+
+    if (!segments || at >= LEDLOCK_BCD_DIGITS) return;
+    for (d = 0; d < 10 && glyphs[d] != segments; ++d)
+        ;
+    s->digits[at]     = '0' + d;
+    s->digits[at + 1] = 0;
+}
+
+static void sim_pause(void *ctx, bool paused) {
+}
+
+static void sim_yield(void *ctx) {
+}
+
+// Loads the count as of now, after checking the sequence before it and that
+//  it follows on from that one's count.
+static void sim_load(void *ctx) {
+    struct sim *s = ctx;
+    __u64 count, expect;
+
+    count = ledlock_core_count(ledlock_core_elapsed(s->now, s->write_ns,
+                                                    s->pause_ns,
+                                                    s->pause_marker,
+                                                    s->paused),
+                               s->cap, s->wrap);
+    if (s->eng.shown) {
+        check_sequence(s);
+        if (count != s->count) {
+            expect = s->count + 1;
+            if (s->wrap && expect == s->cap) expect = 0;
+            if (count != expect) {
+                if (!s->skipped) s->first_skip = s->count;
+                s->skipped += count > expect ? count - expect
+                                             : count + s->cap - expect;
+            }
+        }
+    }
+    if (!s->eng.shown || count != s->count) ++s->values;
+    s->count     = count;
+    s->digits[0] = 0;
+
+    s->eng.program_len = ledlock_core_compile(s->eng.program,
+                                              ledlock_bcd_from(count),
+                                              s->wrap, s->time_display,
+                                              s->time_blank_digit,
+                                              s->time_blank_value);
+}
+
+// Parks the engine unless there is still something to show.
+static unsigned int sim_park(void *ctx) {
+    struct sim *s = ctx;
+
+    if (!s->paused) return 0;
+    s->running = false;
+    return LEDLOCK_IDLE;
+}
+
+static const struct ledlock_core_ops sim_ops = {
+    .latch  = sim_latch,
+    .frame  = sim_frame,
+    .pause  = sim_pause,
+    .yield  = sim_yield,
+    .load   = sim_load,
+    .park   = sim_park,
+};
+
+// The engine timer firing, stepping the engine until it needs a delay.
+static void sim_timer(struct sim *s) {
+    unsigned int delay = 0;
+
+    if (s->poked) {
+        s->poked = false;
+        delay = ledlock_core_preempt(&s->eng, &sim_ops, s, s->paused, true,
+                                     false);
+        if (delay == LEDLOCK_RESUME) {
+            if (s->due > s->now) {
+                s->expires = s->due;    // see out the frame that was cut
+                return;
+            }
+            delay = 0;
+        }
+    }
+    else if (s->due > s->now) {
+        s->expires = s->due;
+        return;
+    }
+
+    while (!delay)
+        delay = ledlock_core_step(&s->eng, &sim_ops, s, true, s->paused,
+                                  true);
+    if (delay == LEDLOCK_IDLE) return;
+
+    if (delay == LEDLOCK_SECOND)
+        s->expires = ledlock_core_forward(s->write_ns + s->pause_ns, s->now,
+                                          LEDLOCK_NSEC_PER_SEC);
+    else
+        s->expires += delay * MS;
+    s->due = s->expires;
+}
+
+// Pauses or unpauses the count at now, posting the pause to a running engine
+//  and kicking a parked one on unpause, as the PON and POFF ioctls do.
+static void sim_toggle(struct sim *s) {
+    if (!s->paused) {
+        ledlock_core_pause(s->now, &s->pause_marker);
+        s->paused = true;
+        if (s->running) {
+            s->poked   = true;
+            s->expires = s->now;
+        }
+        return;
+    }
+
+    ledlock_core_resume(s->now, &s->pause_ns, s->pause_marker);
+    s->paused = false;
+    if (!s->running) {
+        s->running = true;
+        s->poked   = false;
+        s->due     = 0;
+        s->expires = s->now;
+    }
+}
+
+// Runs the engine from a write until the given number of seconds have been
+//  counted: each timer fires latency after it was due, and pauses come in
+//  whenever they fall, cutting frames short as they do in the module.
+static void simulate(struct sim *s) {
+    __u64 toggle, fire, next;
+
+    s->values = s->skipped = s->wrong = s->writes = s->first_skip = 0;
+    s->write_ns = s->now = LEDLOCK_NSEC_PER_SEC;
+    s->pause_ns = s->pause_marker = 0;
+    s->paused   = false;
+    memset(&s->eng, 0, sizeof(s->eng));
+    s->eng.phase = LEDLOCK_PHASE_WAIT;
+
+    // the write kicks the engine
+    s->running = true;
+    s->poked   = false;
+    s->due     = 0;
+    s->expires = s->now;
+    toggle = s->pause_every ? s->write_ns + s->pause_every *
+                              LEDLOCK_NSEC_PER_SEC : ~0ULL;
+
+    for (;;) {
+        fire = s->running ? s->expires + s->latency : ~0ULL;
+        next = toggle < fire ? toggle : fire;
+        if (next == ~0ULL ||
+            ledlock_core_elapsed(next, s->write_ns, s->pause_ns,
+                                 s->pause_marker, s->paused) >=
+            s->seconds * LEDLOCK_NSEC_PER_SEC)
+            break;
+
+        s->now = next;
+        if (toggle == next) {
+            toggle += (s->paused ? s->pause_every : s->pause_length) *
+                      LEDLOCK_NSEC_PER_SEC;
+            sim_toggle(s);
+        }
+        else {
+            sim_timer(s);
+        }
+    }
+
+    // the last sequence, if it got to the end
+    if (s->eng.shown && s->eng.phase == LEDLOCK_PHASE_WAIT) check_sequence(s);
+}
+
+static double now_s(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Tries display times for each cap and pair of gaps, reporting the longest
+//  that never skips a number.
+static int sweep(void) {
+    static const unsigned int blanks[][2] = {
+        { 0, 0 }, { 25, 50 }, { 50, 100 }, { 50, 200 }, { 100, 200 },
+    };
+    struct sim s;
+    unsigned int b, display, best;
+    __u64 cap;
+    int fails = 0;
+
+    memset(&s, 0, sizeof(s));
+    s.wrap = true;
+    for (cap = 10; cap <= 1000000; cap *= 10) {
+        for (b = 0; b < sizeof(blanks) / sizeof(blanks[0]); ++b) {
+            best = 0;
+            for (display = 25; display <= 1000; display += 25) {
+                s.time_display     = display;
+                s.time_blank_digit = blanks[b][0];
+                s.time_blank_value = blanks[b][1];
+                s.cap              = cap;
+                s.seconds          = cap + 10 < 86400 ? cap + 10 : 86400;
+                simulate(&s);
+                if (s.wrong) ++fails;
+                if (s.skipped) break;
+                best = display;
+            }
+            fprintf (stdout, "cap %7llu  gaps %3u/%3u ms  ", cap,
+                     blanks[b][0], blanks[b][1]);
+            if (best)
+                fprintf (stdout, "display up to %u ms never skips\n", best);
+            else
+                fprintf (stdout, "always skips\n");
+        }
+    }
+    if (fails) fprintf (stdout, "%d runs showed wrong digits\n", fails);
+    return fails ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+    struct sim s;
+    double start;
+    int opt;
+
+    memset(&s, 0, sizeof(s));
+    s.time_display     = 200;
+    s.time_blank_digit = 50;
+    s.time_blank_value = 200;
+    s.cap              = 1000000;
+    s.wrap             = true;
+    s.seconds          = 86400;
+
+    while ((opt = getopt(argc, argv, "d:b:v:c:ns:p:l:S")) != -1) {
+        switch (opt) {
+            case 'd': s.time_display     = atoi(optarg);        break;
+            case 'b': s.time_blank_digit = atoi(optarg);        break;
+            case 'v': s.time_blank_value = atoi(optarg);        break;
+            case 'c': s.cap              = strtoull(optarg, NULL, 10); break;
+            case 'n': s.wrap             = false;               break;
+            case 's': s.seconds          = strtoull(optarg, NULL, 10); break;
+            case 'l': s.latency          = atoll(optarg) * 1000ULL; break;
+            case 'p':
+                if (sscanf(optarg, "%llu:%llu", &s.pause_every,
+                           &s.pause_length) != 2) {
+                    fprintf (stderr, "coresim: -p every:length\n");
+                    return -1;
+                }
+                break;
+            case 'S': return sweep();
+            default:
+                fprintf (stderr, "coresim: see the top of coresim.c\n");
+                return -1;
+        }
+    }
+    start = now_s();
+    simulate(&s);
+    fprintf (stdout, "%llu s counted in %.3f s: %llu values shown, "
+             "%llu skipped, %llu wrong, %llu port writes\n", s.seconds,
+             now_s() - start, s.values, s.skipped, s.wrong, s.writes);
+    if (s.skipped)
+        fprintf (stdout, "first skip after %llu\n", s.first_skip);
+
+    return s.skipped || s.wrong ? 1 : 0;
+}
@@ -0,0 +1,108 @@
+// test program which measures how long pause and display commands take to
+//  show on the port (load with backend=sim). Issues each command at random
+//  points of a slow digit sequence and fails if the worst delay exceeds the
+//  bound given in microseconds, 2000 by default. A command that leaves the
+//  port as it was, such as pausing on a digit, writes nothing, so only those
+//  that changed it are timed.
+
+#include "ledlock.h"
+#include "ledlock_test.h"
+
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+// Issues a command and returns how long until the port was next written,
+//  or 0 if it never was.
+static unsigned long long timed(int fd, int sim, unsigned long cmd) {
+    struct ledlock_sim_record recs[64];
+    unsigned long long start;
+    int i, n;
+
+    while (read (sim, recs, sizeof(recs)) > 0)
+        ;
+    start = now_ns();
+    ioctl(fd, cmd);
+    usleep(20000);
+
+    n = read (sim, recs, sizeof(recs));
+    for (i = 0; i < n / (int)sizeof(recs[0]); ++i) {
+        if (recs[i].time_ns >= start) return recs[i].time_ns - start;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    static const unsigned long cmds[] = {
+        IOCTL_LEDLOCK_PON, IOCTL_LEDLOCK_POFF,
+        IOCTL_LEDLOCK_DOFF, IOCTL_LEDLOCK_DON,
+    };
+    static const char *names[] = { "pause", "unpause", "display off",
+                                   "display on" };
+    unsigned long long bound = (argc > 1 ? atoll(argv[1]) : 2000) * 1000ULL;
+    unsigned long long worst[4] = { 0 }, total[4] = { 0 }, t;
+    int shown[4] = { 0 };
+    unsigned int cap = 1000;
+    int fd, sim, i, c, fails = 0, rounds = 50;
+    struct ledlock_config cfg;
+    char stats[128];
+
+    if ((fd = open ("/dev/ledlock0", O_RDWR )) == -1) {
+        perror("ctllatency opening file");
+        return -1;
+    }
+    if ((sim = open ("/sys/kernel/debug/ledlock/ledlock0/sim",
+                     O_RDONLY)) == -1) {
+        perror("ctllatency opening sim");
+        return -1;
+    }
+
+    // long digits, as in ioctl_timel, so commands mostly land mid-frame
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.mask             = LEDLOCK_CFG_ALL;
+    cfg.flags            = LEDLOCK_STATUS_WRAP | LEDLOCK_STATUS_DISPLAY;
+    cfg.time_display     = 700;
+    cfg.time_blank_digit = 100;
+    cfg.time_blank_value = 100;
+    ioctl(fd, IOCTL_LEDLOCK_SET_CONFIG, &cfg);
+    write (fd, &cap, sizeof(cap));
+    srand(time(NULL));
+
+    for (i = 0; i < rounds; ++i) {
+        for (c = 0; c < 4; ++c) {
+            usleep(rand() % 900000);
+            t = timed(fd, sim, cmds[c]);
+            if (!t) continue;
+            ++shown[c];
+            total[c] += t;
+            if (t > worst[c]) worst[c] = t;
+        }
+    }
+
+    for (c = 0; c < 4; ++c) {
+        fprintf (stdout, "%-12s %2d/%d shown  mean %8.3f us  max %8.3f us%s\n",
+                 names[c], shown[c], rounds,
+                 shown[c] ? total[c] / 1e3 / shown[c] : 0.0, worst[c] / 1e3,
+                 worst[c] > bound ? "  OVER BOUND" : "");
+        if (!shown[c] || worst[c] > bound) ++fails;
+    }
+
+    // and the driver's own view, from command to output
+    close(sim);
+    if ((sim = open ("/sys/kernel/debug/ledlock/ledlock0/latency",
+                     O_RDONLY)) != -1) {
+        i = read (sim, stats, sizeof(stats) - 1);
+        if (i > 0) {
+            stats[i] = 0;
+            fprintf (stdout, "%s", stats);
+        }
+        close(sim);
+    }
+    close(fd);
+
+    return fails ? 1 : 0;
+}
@@ -0,0 +1,100 @@
+// test program which checks that seconds stay locked to the write() instant
+//  over a long run (load with backend=sim). Each digit sequence should start
+//  a whole number of seconds after the write, none skipped. Takes the run
+//  length in seconds, three hours by default.
+
+#include "ledlock.h"
+#include "ledlock_test.h"
+
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+int main(int argc, char **argv) {
+    int fd, sim, i, n;
+    long long run = argc > 1 ? atoll(argv[1]) : 3 * 3600;
+    unsigned int cap = 100;
+    struct ledlock_config cfg;
+    struct ledlock_sim_record recs[64];
+    unsigned long long start, last = 0, k, prev = 0, offset;
+    unsigned long long samples = 0, total = 0, worst = 0, skipped = 0;
+    char stats[128];
+
+    if ((fd = open ("/dev/ledlock0", O_RDWR )) == -1) {
+        perror("driftcheck opening file");
+        return -1;
+    }
+    if ((sim = open ("/sys/kernel/debug/ledlock/ledlock0/sim",
+                     O_RDONLY)) == -1) {
+        perror("driftcheck opening sim");
+        return -1;
+    }
+
+    // short sequences, so each second starts after a long quiet gap
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.mask             = LEDLOCK_CFG_WRAP | LEDLOCK_CFG_TIME_DISPLAY |
+                           LEDLOCK_CFG_BLANK_DIGIT | LEDLOCK_CFG_BLANK_VALUE;
+    cfg.flags            = LEDLOCK_STATUS_WRAP;
+    cfg.time_display     = 100;
+    cfg.time_blank_digit = 50;
+    cfg.time_blank_value = 50;
+    if (ioctl(fd, IOCTL_LEDLOCK_SET_CONFIG, &cfg) == -1) {
+        perror("driftcheck configuring");
+        return -1;
+    }
+
+    // drop anything recorded before the write
+    while (read (sim, recs, sizeof(recs)) > 0)
+        ;
+    start = now_ns();
+    write (fd, &cap, sizeof(cap));
+
+    while (now_ns() - start < run * 1000000000ULL) {
+        n = read (sim, recs, sizeof(recs));
+        if (n <= 0) {
+            usleep(100000);
+            continue;
+        }
+
+        for (i = 0; i < n / (int)sizeof(recs[0]); ++i) {
+            // a write after a long gap opens a new second
+            if (recs[i].time_ns - last > 400000000ULL && last) {
+                k = (recs[i].time_ns - start + 500000000ULL) / 1000000000ULL;
+                offset = recs[i].time_ns - start - k * 1000000000ULL;
+                if (k != prev + 1) {
+                    fprintf (stdout, "second %llu follows %llu\n", k, prev);
+                    ++skipped;
+                }
+                prev = k;
+
+                ++samples;
+                total += offset;
+                if (offset > worst) worst = offset;
+            }
+            last = recs[i].time_ns;
+        }
+    }
+
+    fprintf (stdout, "%llu seconds, %llu skipped, offset mean %.3f us, "
+             "max %.3f us\n", samples, skipped,
+             samples ? total / 1e3 / samples : 0.0, worst / 1e3);
+
+    // and the driver's own view of the same boundaries
+    close(sim);
+    if ((sim = open ("/sys/kernel/debug/ledlock/ledlock0/drift",
+                     O_RDONLY)) != -1) {
+        n = read (sim, stats, sizeof(stats) - 1);
+        if (n > 0) {
+            stats[n] = 0;
+            fprintf (stdout, "%s", stats);
+        }
+        close(sim);
+    }
+    close(fd);
+
+    return skipped ? 1 : 0;
+}
@@ -0,0 +1,57 @@
+// test program which sets the display timings, wrap and display state in a
+//  single batched ioctl, then reads the whole configuration back. A timing
+//  past LEDLOCK_MAX_TIME_MS must be refused and leave the rest alone.
+
+#include "ledlock.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+int main(int argc, char **argv) {
+    int fd;
+    struct ledlock_config cfg = {0};
+
+    if ((fd = open ("/dev/ledlock0", O_RDWR )) == -1) {
+        perror("ioctlcfg opening file");
+        return -1;
+    }
+
+    // ioctlcfg [display blank_digit blank_value]
+    cfg.mask = LEDLOCK_CFG_WRAP | LEDLOCK_CFG_DISPLAY |
+               LEDLOCK_CFG_TIME_DISPLAY | LEDLOCK_CFG_BLANK_DIGIT |
+               LEDLOCK_CFG_BLANK_VALUE;
+    cfg.flags = LEDLOCK_STATUS_WRAP | LEDLOCK_STATUS_DISPLAY;
+    cfg.time_display     = argc > 1 ? atoi(argv[1]) : 300;
+    cfg.time_blank_digit = argc > 2 ? atoi(argv[2]) : 100;
+    cfg.time_blank_value = argc > 3 ? atoi(argv[3]) : 500;
+
+    if (ioctl (fd, IOCTL_LEDLOCK_SET_CONFIG, &cfg) == -1) {
+        perror("ioctlcfg setting config");
+        return -1;
+    }
+    cfg.mask         = LEDLOCK_CFG_TIME_DISPLAY;
+    cfg.time_display = ~0U;
+    if (ioctl (fd, IOCTL_LEDLOCK_SET_CONFIG, &cfg) != -1 || errno != EINVAL ||
+        ioctl (fd, IOCTL_LEDLOCK_SHOW, LEDLOCK_MAX_TIME_MS + 1) != -1) {
+        fprintf (stdout, "ioctlcfg: a timing too long was taken\n");
+        return 1;
+    }
+    if (ioctl (fd, IOCTL_LEDLOCK_GET_CONFIG, &cfg) == -1) {
+        perror("ioctlcfg getting config");
+        return -1;
+    }
+
+    fprintf (stdout, "paused %d  wrap %d  display %d\n",
+             !!(cfg.flags & LEDLOCK_STATUS_PAUSED),
+             !!(cfg.flags & LEDLOCK_STATUS_WRAP),
+             !!(cfg.flags & LEDLOCK_STATUS_DISPLAY));
+    fprintf (stdout, "display %u ms  blank digit %u ms  blank value %u ms\n",
+             cfg.time_display, cfg.time_blank_digit, cfg.time_blank_value);
+    close(fd);
+
+    return 0;
+}
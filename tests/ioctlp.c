@@ -8,15 +8,29 @@
 
 int main() {
     int fd;
+    unsigned int cap = 1000, before, during, after;
     
     if ((fd = open("/dev/ledlock0", O_RDWR)) == -1) {
         printf("Error: ioctlp opening file\n");
         return -1;
     }
-    // pause and unpause
+    write(fd, &cap, sizeof(cap));
+    sleep(2);
+
+    // pause and unpause, the count should hold still meanwhile
     ioctl(fd, IOCTL_LEDLOCK_PON,    42);
+    read(fd, &before, sizeof(before));
     sleep(5);
+    read(fd, &during, sizeof(during));
     ioctl(fd, IOCTL_LEDLOCK_POFF,   42);
+    sleep(2);
+    read(fd, &after, sizeof(after));
 
+    printf("paused at %u, %u after 5 s, %u 2 s after unpausing\n",
+           before, during, after);
+    if (during != before || after < before + 1 || after > before + 3) {
+        printf("Error: ioctlp count moved while paused or not after\n");
+        return 1;
+    }
     return 0;
 }
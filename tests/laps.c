@@ -0,0 +1,109 @@
+// test program for the lap history: samples the count with IOCTL_LEDLOCK_LAP
+//  and drains the laps with one IOCTL_LEDLOCK_LAPS, checking each lap's count
+//  against its elapsed time, its numbering and the pause flag. Then overfills
+//  the ring and checks the dropped total. Also prints what a lap costs next
+//  to a read() of the count.
+
+#include "ledlock.h"
+#include "ledlock_test.h"
+
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#define LAPS    100
+#define BURST   (LEDLOCK_LAP_RECORDS + 44)
+
+static int fails;
+static struct ledlock_lap laps[LEDLOCK_LAP_RECORDS * 2];
+
+static void check(const char *what, int ok) {
+    if (ok) return;
+    fprintf (stdout, "laps: %s\n", what);
+    ++fails;
+}
+
+static void lap(int fd) {
+    if (ioctl(fd, IOCTL_LEDLOCK_LAP)) {
+        perror("laps recording a lap");
+        exit(-1);
+    }
+}
+
+// Drains the ring in one call, returning how many laps came out.
+static unsigned int drain(int fd, unsigned long long *dropped) {
+    struct ledlock_laps req;
+
+    memset(&req, 0, sizeof(req));
+    req.laps = (unsigned long)laps;
+    req.max  = sizeof(laps) / sizeof(laps[0]);
+    if (ioctl(fd, IOCTL_LEDLOCK_LAPS, &req)) {
+        perror("laps draining");
+        exit(-1);
+    }
+    if (dropped) *dropped = req.dropped;
+    return req.count;
+}
+
+int main() {
+    unsigned int cap = 1000, val, n, i;
+    unsigned long long before, after, t;
+    int fd;
+
+    if ((fd = open ("/dev/ledlock0", O_RDWR)) == -1) {
+        perror("laps opening file");
+        return -1;
+    }
+    write (fd, &cap, sizeof(cap));
+    drain(fd, NULL);
+
+    // what one sample costs either way
+    t = now_ns();
+    for (i = 0; i < LAPS; ++i) read (fd, &val, sizeof(val));
+    fprintf (stdout, "read()  %8llu ns each\n", (now_ns() - t) / LAPS);
+    t = now_ns();
+    for (i = 0; i < LAPS; ++i) lap(fd);
+    fprintf (stdout, "lap     %8llu ns each\n", (now_ns() - t) / LAPS);
+
+    // every lap comes back in order, its count agreeing with its time
+    n = drain(fd, &before);
+    fprintf (stdout, "%u laps in one drain\n", n);
+    check("lost laps", n == LAPS);
+    for (i = 0; i < n; ++i) {
+        check("count disagrees with elapsed",
+              laps[i].count == laps[i].elapsed_ns / 1000000000ULL % cap);
+        if (!i) continue;
+        check("laps out of order", laps[i].time_ns >= laps[i - 1].time_ns &&
+                                   laps[i].elapsed_ns >= laps[i - 1].elapsed_ns);
+        check("gap in lap numbers", laps[i].seq == laps[i - 1].seq + 1);
+    }
+
+    // a paused count is flagged and holds still
+    sleep(1);
+    ioctl(fd, IOCTL_LEDLOCK_PON);
+    lap(fd);
+    usleep(200000);
+    lap(fd);
+    ioctl(fd, IOCTL_LEDLOCK_POFF);
+    n = drain(fd, NULL);
+    check("lost paused laps", n == 2);
+    check("pause not flagged", n == 2 &&
+          (laps[0].flags & laps[1].flags & LEDLOCK_STATUS_PAUSED));
+    check("count moved while paused", n == 2 &&
+          laps[0].elapsed_ns == laps[1].elapsed_ns);
+
+    // overfilling the ring drops the excess, whichever end it comes off
+    for (i = 0; i < BURST; ++i) lap(fd);
+    n = drain(fd, &after);
+    fprintf (stdout, "%u laps kept of %u, %llu dropped, seq %u to %u\n", n,
+             BURST, after - before, laps[0].seq, laps[n ? n - 1 : 0].seq);
+    check("ring not full", n == LEDLOCK_LAP_RECORDS);
+    check("drops not counted", after - before == BURST - n);
+
+    close(fd);
+    return fails ? 1 : 0;
+}
@@ -0,0 +1,57 @@
+/*  Code by Preston Hamlin
+Helpers shared by the test programs: a monotonic clock in ns, and reading
+    numbers out of the module's debugfs files, either a file holding just
+    the one number or the "name value" lines of a file such as stats.
+*/
+
+#ifndef LEDLOCK_TEST_H
+#define LEDLOCK_TEST_H
+
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <time.h>
+
+
+static inline unsigned long long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Picks the named line's number out of text already read, or if name is
+//  NULL takes the text as the one number. 0 if it isn't there.
+static inline unsigned long long stat_value(const char *text,
+                                            const char *name)
+{
+    char key[64];
+    const char *at;
+
+    if (!name) return strtoull(text, NULL, 10);
+
+    snprintf(key, sizeof(key), "%s ", name);
+    for (at = text; (at = strstr(at, key)); ++at) {
+        if (at == text || at[-1] == '\n')
+            return strtoull(at + strlen(key), NULL, 10);
+    }
+    return 0;
+}
+
+// Reads one number, either a whole file or the named line of one.
+static inline unsigned long long counter(const char *path, const char *name) {
+    char text[1024];
+    int fd, n;
+
+    if ((fd = open (path, O_RDONLY)) == -1) return 0;
+    n = read (fd, text, sizeof(text) - 1);
+    close(fd);
+    if (n <= 0) return 0;
+    text[n] = 0;
+
+    return stat_value(text, name);
+}
+
+#endif
@@ -0,0 +1,43 @@
+// test program which samples the timer through the mmap()ed status page,
+//  printing each new count along with how many samples it took
+
+#include "ledlock_status.h"
+
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+
+int main() {
+    int fd;
+    const struct ledlock_status *page;
+    struct ledlock_status snap;
+    unsigned long long val, last = ~0ULL, samples = 0;
+
+    if ((fd = open ("/dev/ledlock0", O_RDONLY )) == -1) {
+        perror("mmaptime opening file");
+        return -1;
+    }
+    if (!(page = ledlock_status_map(fd))) {
+        perror("mmaptime mapping status page");
+        return -1;
+    }
+
+    for (;;) {
+        ledlock_status_read(page, &snap);
+        val = ledlock_status_count(&snap);
+        ++samples;
+
+        if (val != last) {
+            fprintf (stdout, "mmaptime: \"%llu\" after %llu samples%s\n",
+                     val, samples,
+                     (snap.flags & LEDLOCK_STATUS_PAUSED) ? " (paused)" : "");
+            fflush(stdout);
+            last = val;
+            samples = 0;
+        }
+    }
+    close(fd);
+
+    return 0;
+}
@@ -0,0 +1,72 @@
+// test program which checks that a paused or blanked display costs nothing
+//  (load with backend=sim): no timer wakeups and no port writes for as long
+//  as it stays that way, then straight back to work once resumed. Nothing
+//  else should be using the module meanwhile. Takes the length of each
+//  idle spell in seconds, 60 by default.
+
+#include "ledlock.h"
+#include "ledlock_test.h"
+
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+
+#define DEBUGFS "/sys/kernel/debug/ledlock/"
+
+// Leaves the display idle for a while and returns whether it stayed so.
+static int idle(const char *what, int seconds) {
+    unsigned long long wheel, wakeups, writes;
+
+    usleep(100000);     // let the last frame land
+    wheel   = counter(DEBUGFS "wakeups", NULL);
+    wakeups = counter(DEBUGFS "ledlock0/stats", "wakeups");
+    writes  = counter(DEBUGFS "ledlock0/stats", "port_writes");
+    sleep(seconds);
+    wheel   = counter(DEBUGFS "wakeups", NULL) - wheel;
+    wakeups = counter(DEBUGFS "ledlock0/stats", "wakeups") - wakeups;
+    writes  = counter(DEBUGFS "ledlock0/stats", "port_writes") - writes;
+
+    fprintf (stdout, "%s %d s: %llu timer wakeups (%llu for the display), "
+             "%llu port writes\n", what, seconds, wheel, wakeups, writes);
+    return wheel || wakeups || writes;
+}
+
+int main(int argc, char **argv) {
+    int fd, fails = 0;
+    int run = argc > 1 ? atoi(argv[1]) : 60;
+    unsigned int cap = 1000;
+    unsigned long long before;
+
+    if ((fd = open ("/dev/ledlock0", O_RDWR )) == -1) {
+        perror("pausewake opening file");
+        return -1;
+    }
+    write (fd, &cap, sizeof(cap));
+    sleep(2);
+
+    ioctl(fd, IOCTL_LEDLOCK_PON);
+    fails += idle("paused", run);
+    before = counter(DEBUGFS "ledlock0/stats", "frames");
+    ioctl(fd, IOCTL_LEDLOCK_POFF);
+    sleep(2);
+    if (counter(DEBUGFS "ledlock0/stats", "frames") == before) {
+        fprintf (stdout, "pausewake: no frames after unpausing\n");
+        ++fails;
+    }
+
+    ioctl(fd, IOCTL_LEDLOCK_DOFF);
+    fails += idle("display off", run);
+    before = counter(DEBUGFS "ledlock0/stats", "frames");
+    ioctl(fd, IOCTL_LEDLOCK_DON);
+    sleep(2);
+    if (counter(DEBUGFS "ledlock0/stats", "frames") == before) {
+        fprintf (stdout, "pausewake: no frames after display on\n");
+        ++fails;
+    }
+
+    close(fd);
+    return fails ? 1 : 0;
+}
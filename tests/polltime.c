@@ -0,0 +1,53 @@
+// test program which waits on the timer with epoll rather than busy-reading
+//  it, printing the count on each tick along with any cap or pause events
+
+#include "ledlock.h"
+
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+
+int main() {
+    int fd, ep;
+    unsigned int val, events;
+    struct epoll_event ev;
+
+    if ((fd = open ("/dev/ledlock0", O_RDWR )) == -1) {
+        perror("polltime opening file");
+        return -1;
+    }
+
+    ep = epoll_create1(0);
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLPRI;
+    ev.data.fd = fd;
+    if (ep == -1 || epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("polltime setting up epoll");
+        return -1;
+    }
+
+    for (;;) {
+        if (epoll_wait(ep, &ev, 1, -1) != 1) {
+            perror("polltime waiting");
+            break;
+        }
+
+        if (ev.events & EPOLLPRI) {
+            ioctl(fd, IOCTL_LEDLOCK_EVENTS, &events);
+            if (events & LEDLOCK_EVENT_CAP)   fprintf (stdout, "cap reached\n");
+            if (events & LEDLOCK_EVENT_PAUSE) fprintf (stdout, "pause toggled\n");
+        }
+        if (ev.events & EPOLLIN) {
+            read (fd, &val, sizeof(val));
+            fprintf (stdout, "polltime: \"%u\"\n", val);
+        }
+        fflush(stdout);
+    }
+    close(ep);
+    close(fd);
+
+    return 0;
+}
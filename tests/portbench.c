@@ -0,0 +1,87 @@
+// benchmark of port writes per displayed value (load with backend=sim):
+//  runs the display through a few typical spells and reports, for each, the
+//  writes the driver issued against those its shadow register suppressed,
+//  that is, how many of the writes it would once have made were saved. Takes
+//  the length of each spell in seconds, 10 by default.
+
+#include "ledlock.h"
+#include "ledlock_test.h"
+
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+
+#define STATS "/sys/kernel/debug/ledlock/ledlock0/stats"
+
+// Sets wrap and the timings, and starts counting up to cap.
+static void start(int fd, int wrap, unsigned int cap) {
+    struct ledlock_config cfg;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.mask             = LEDLOCK_CFG_ALL;
+    cfg.flags            = (wrap ? LEDLOCK_STATUS_WRAP : 0) |
+                           LEDLOCK_STATUS_DISPLAY;
+    cfg.time_display     = 100;
+    cfg.time_blank_digit = 50;
+    cfg.time_blank_value = 50;
+    ioctl(fd, IOCTL_LEDLOCK_SET_CONFIG, &cfg);
+    write (fd, &cap, sizeof(cap));
+}
+
+// Lets a spell run and reports the writes made during it.
+static void spell(int st, const char *what, int seconds) {
+    unsigned long long issued, saved;
+
+    write (st, "1", 1);
+    sleep(seconds);
+    issued = counter(STATS, "port_writes");
+    saved  = counter(STATS, "port_suppressed");
+
+    fprintf (stdout, "%-22s %8.2f writes/value  %8.2f saved/value  "
+             "%5.1f%% fewer\n", what, (double)issued / seconds,
+             (double)saved / seconds,
+             issued + saved ? 100.0 * saved / (issued + saved) : 0.0);
+}
+
+int main(int argc, char **argv) {
+    int fd, st;
+    int run = argc > 1 ? atoi(argv[1]) : 10;
+
+    if ((fd = open ("/dev/ledlock0", O_RDWR )) == -1) {
+        perror("portbench opening file");
+        return -1;
+    }
+    if ((st = open (STATS, O_RDWR)) == -1) {
+        perror("portbench opening stats");
+        return -1;
+    }
+
+    // digits blanked between, so each frame changes the port
+    start(fd, 1, 1000000);
+    spell(st, "counting, wrap", run);
+
+    // digits held rather than blanked, so repeats such as 11 go unwritten
+    start(fd, 0, 1000000);
+    spell(st, "counting, no wrap", run);
+
+    // halted at the cap, the same value redisplayed each second
+    start(fd, 0, 1);
+    sleep(2);
+    spell(st, "halted at cap", run);
+
+    // paused and blanked, the last frame latched
+    start(fd, 1, 1000000);
+    ioctl(fd, IOCTL_LEDLOCK_PON);
+    spell(st, "paused", run);
+    ioctl(fd, IOCTL_LEDLOCK_POFF);
+    ioctl(fd, IOCTL_LEDLOCK_DOFF);
+    spell(st, "display off", run);
+    ioctl(fd, IOCTL_LEDLOCK_DON);
+
+    close(st);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,47 @@
+// test program which writes a cap too big for 32 bits, pauses the count
+//  twice along the way and checks that a 64 bit read only counts the time
+//  spent unpaused
+
+#include "ledlock.h"
+
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+
+int main() {
+    int fd, i;
+    unsigned long long cap = 1ULL << 40, val = 0;
+    unsigned int val32 = 0;
+
+    if ((fd = open ("/dev/ledlock0", O_RDWR )) == -1) {
+        perror("readtime64 opening file");
+        return -1;
+    }
+
+    if (write (fd, &cap, sizeof(cap)) != sizeof(cap)) {
+        perror("readtime64 writing");
+        return -1;
+    }
+
+    // two seconds counting then one paused, twice over, then one more
+    for (i = 0; i < 2; ++i) {
+        usleep(2000000);
+        ioctl(fd, IOCTL_LEDLOCK_PON);
+        usleep(1000000);
+        ioctl(fd, IOCTL_LEDLOCK_POFF);
+    }
+    usleep(1000000);
+
+    read (fd, &val, sizeof(val));
+    read (fd, &val32, sizeof(val32));
+    fprintf (stdout, "\nreadtime64: \"%llu\" (32 bit \"%u\")\n", val, val32);
+    close(fd);
+
+    if (val != 5 || val32 != 5) {
+        fprintf (stdout, "readtime64: expected 5\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,139 @@
+// test program for per-file timer sessions: two files take sessions of their
+//  own and a third keeps the shared count. Each count must run on its own,
+//  unmoved by writes and pauses through the others, and two sessions of
+//  equal priority must take turns on the display, unless both are paused,
+//  while a higher priority one keeps it. A paused session coming on show
+//  must not be left showing the digit of the one before. Prints the
+//  sessions list along the way.
+
+#include "ledlock_status.h"
+#include "ledlock_test.h"
+
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+
+#define DEBUGFS "/sys/kernel/debug/ledlock/ledlock0/"
+
+static int fails;
+
+static unsigned int count(int fd) {
+    unsigned int val = 0;
+
+    read (fd, &val, sizeof(val));
+    return val;
+}
+
+static void expect(const char *what, unsigned int got, unsigned int lo,
+                   unsigned int hi)
+{
+    fprintf (stdout, "%-32s %u\n", what, got);
+    if (got < lo || got > hi) {
+        fprintf (stdout, "sessions: expected %u to %u\n", lo, hi);
+        ++fails;
+    }
+}
+
+static void session(int fd, int priority, unsigned int slice_ms) {
+    struct ledlock_session_config cfg = { priority, slice_ms };
+
+    if (ioctl(fd, IOCTL_LEDLOCK_SESSION, &cfg)) {
+        perror("sessions setting a session");
+        exit(-1);
+    }
+}
+
+// Reads the stats counter of session switches.
+static unsigned long long switches(void) {
+    return counter(DEBUGFS "stats", "session_switches");
+}
+
+static void list(void) {
+    char text[1024];
+    int fd, n;
+
+    if ((fd = open (DEBUGFS "sessions", O_RDONLY)) == -1) return;
+    n = read (fd, text, sizeof(text) - 1);
+    close(fd);
+    if (n > 0) fwrite(text, 1, n, stdout);
+}
+
+int main() {
+    int shared, a, b;
+    unsigned int cap = 1000;
+    unsigned long long before;
+    const struct ledlock_status *page;
+    struct ledlock_status snap;
+
+    if ((shared = open ("/dev/ledlock0", O_RDWR)) == -1 ||
+        (a = open ("/dev/ledlock0", O_RDWR)) == -1 ||
+        (b = open ("/dev/ledlock0", O_RDWR)) == -1) {
+        perror("sessions opening file");
+        return -1;
+    }
+    if (!(page = ledlock_status_map(shared))) {
+        perror("sessions mapping status page");
+        return -1;
+    }
+
+    write (shared, &cap, sizeof(cap));
+    sleep(2);
+    session(a, 1, 1000);
+    session(b, 1, 1000);
+    expect("unwritten session", count(a), 0, 0);
+
+    // a's write must not reset the shared count
+    write (a, &cap, sizeof(cap));
+    sleep(2);
+    expect("shared count after 4 s", count(shared), 3, 5);
+    expect("session a after 2 s", count(a), 1, 3);
+
+    // nor b's pause stop a
+    write (b, &cap, sizeof(cap));
+    ioctl(b, IOCTL_LEDLOCK_PON);
+    sleep(2);
+    expect("session a after 4 s", count(a), 3, 5);
+    expect("paused session b", count(b), 0, 0);
+    ioctl(b, IOCTL_LEDLOCK_POFF);
+    list();
+
+    // a and b share priority 1 and take turns of a second
+    before = switches();
+    sleep(4);
+    expect("turns taken in 4 s", switches() - before, 2, 5);
+
+    // but not while both are paused, when a turn would change nothing
+    ioctl(a, IOCTL_LEDLOCK_PON);
+    ioctl(b, IOCTL_LEDLOCK_PON);
+    before = switches();
+    sleep(3);
+    expect("turns taken while paused", switches() - before, 0, 0);
+    ioctl(a, IOCTL_LEDLOCK_POFF);
+    ioctl(b, IOCTL_LEDLOCK_POFF);
+
+    // until a goes higher and keeps the display
+    session(a, 2, 0);
+    sleep(1);
+    before = switches();
+    sleep(3);
+    expect("turns taken with a first", switches() - before, 0, 0);
+    list();
+
+    // closing a hands the display to b, paused, which shows blank rather
+    //  than holding a's last digit
+    ioctl(b, IOCTL_LEDLOCK_PON);
+    close(a);
+    usleep(100000);
+    ledlock_status_read(page, &snap);
+    expect("digit left up for paused b", snap.last_digit, 0, 0);
+    ioctl(b, IOCTL_LEDLOCK_POFF);
+    sleep(1);
+    list();
+
+    close(b);
+    close(shared);
+    return fails ? 1 : 0;
+}
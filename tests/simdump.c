@@ -0,0 +1,50 @@
+// test program which drains the simulated port and prints each write along
+//  with how long the previous value was held (load with backend=sim), for
+//  the display numbered by the optional argument, or the first
+
+#include "ledlock.h"
+
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdlib.h>
+
+int main(int argc, char **argv) {
+    int fd, i, n;
+    struct ledlock_sim_record recs[64];
+    unsigned long long first = 0, last = 0;
+    char path[64];
+
+    snprintf(path, sizeof(path), "/sys/kernel/debug/ledlock/ledlock%d/sim",
+             argc > 1 ? atoi(argv[1]) : 0);
+    if ((fd = open (path, O_RDONLY)) == -1) {
+        perror("simdump opening file");
+        return -1;
+    }
+
+    // poll for new records until interrupted
+    for (;;) {
+        n = read (fd, recs, sizeof(recs));
+        if (n < 0) {
+            perror("simdump reading");
+            break;
+        }
+        if (n == 0) {
+            usleep(100000);
+            continue;
+        }
+
+        for (i = 0; i < n / (int)sizeof(recs[0]); ++i) {
+            if (!first) first = last = recs[i].time_ns;
+            fprintf (stdout, "%12.6f  0x%02x  held %8.3f ms\n",
+                     (recs[i].time_ns - first) / 1e9, recs[i].segments,
+                     (recs[i].time_ns - last) / 1e6);
+            last = recs[i].time_ns;
+        }
+        fflush(stdout);
+    }
+    close(fd);
+
+    return 0;
+}
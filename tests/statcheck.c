@@ -0,0 +1,59 @@
+// test program which resets a display's counters, lets it count for a while
+//  and then checks them, the way a monitor would to catch a unit that has
+//  fallen behind. Fails if any second went unshown or any step was late by
+//  more than a ms. Takes the run length in seconds, 10 by default.
+
+#include "ledlock.h"
+#include "ledlock_test.h"
+
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+
+#define STATS "/sys/kernel/debug/ledlock/ledlock0/stats"
+
+int main(int argc, char **argv) {
+    int fd, st, n;
+    int run = argc > 1 ? atoi(argv[1]) : 10;
+    unsigned int cap = 1000, val;
+    char text[1024];
+
+    if ((fd = open ("/dev/ledlock0", O_RDWR )) == -1) {
+        perror("statcheck opening file");
+        return -1;
+    }
+    if ((st = open (STATS, O_RDWR)) == -1) {
+        perror("statcheck opening stats");
+        return -1;
+    }
+
+    write (st, "1", 1);
+    write (fd, &cap, sizeof(cap));
+    sleep(run);
+    read (fd, &val, sizeof(val));
+
+    lseek(st, 0, SEEK_SET);
+    n = read (st, text, sizeof(text) - 1);
+    close(st);
+    close(fd);
+    if (n <= 0) {
+        perror("statcheck reading stats");
+        return -1;
+    }
+    text[n] = 0;
+    fprintf (stdout, "%s", text);
+
+    if (!stat_value(text, "frames") || stat_value(text, "reads") != 1 ||
+        stat_value(text, "writes") != 1) {
+        fprintf (stdout, "statcheck: counters not kept\n");
+        return 1;
+    }
+    if (stat_value(text, "skipped_seconds") ||
+        stat_value(text, "deadline_misses")) {
+        fprintf (stdout, "statcheck: display fell behind\n");
+        return 1;
+    }
+    return 0;
+}
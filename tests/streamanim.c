@@ -0,0 +1,57 @@
+// test program which switches the device to stream mode and plays a spinner
+//  round the outer segments at the given frame rate (default 200 fps) for
+//  ten seconds, handing the driver a whole batch of frames per write
+
+#include "ledlock.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#define BATCH 256
+
+int main(int argc, char **argv) {
+    static const unsigned char ring[6] = {
+        0x10, 0x20, 0x08, 0x01, 0x02, 0x40,     // T, TR, BR, B, BL, TL
+    };
+    struct ledlock_frame_record frames[BATCH] = {{0}};
+    int fd, fps, total, sent = 0, writes = 0, i, n;
+
+    fps = argc > 1 ? atoi(argv[1]) : 200;
+    if (fps <= 0) fps = 200;
+    total = fps * 10;
+
+    if ((fd = open ("/dev/ledlock0", O_RDWR )) == -1) {
+        perror("streamanim opening file");
+        return -1;
+    }
+    if (ioctl (fd, IOCTL_LEDLOCK_MODE, LEDLOCK_MODE_STREAM) == -1) {
+        perror("streamanim setting stream mode");
+        return -1;
+    }
+
+    // each write blocks until the driver has room for more
+    while (sent < total) {
+        for (i = 0; i < BATCH; ++i) {
+            frames[i].segments    = ring[(sent + i) % 6];
+            frames[i].duration_us = 1000000 / fps;
+        }
+        n = write (fd, frames, sizeof(frames));
+        if (n < 0) {
+            perror("streamanim writing frames");
+            break;
+        }
+        sent += n / sizeof(frames[0]);
+        ++writes;
+    }
+    fprintf (stdout, "%d frames in %d writes\n", sent, writes);
+
+    // let the queue play out before handing the display back to the counter
+    sleep (2 + BATCH / fps);
+    ioctl (fd, IOCTL_LEDLOCK_MODE, LEDLOCK_MODE_COUNT);
+    close(fd);
+
+    return 0;
+}
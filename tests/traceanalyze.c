@@ -0,0 +1,174 @@
+// test program which reads ledlock trace events, as printed by trace_pipe,
+//  and prints histograms of how far the driver strayed from its timings:
+//
+//      echo 1 > /sys/kernel/tracing/events/ledlock/enable
+//      ./traceanalyze [file] [seconds]
+//
+//  Reads trace_pipe itself unless given a file, "-" for stdin, and runs until
+//  the input ends, the seconds run out or it is interrupted. Dwell error is
+//  how much longer or shorter each frame stayed up than it should have, for
+//  frames played back to back. Jitter is how late each event happened after
+//  it was due.
+
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+
+#define MINORS  8       // as many displays as the module drives
+#define BUCKETS 22      // under 1 us, then doubling up to over a second
+
+struct hist {
+    const char *name;
+    unsigned long long count[BUCKETS];
+    unsigned long long samples, max;
+    long long total;
+    unsigned long long early;
+};
+
+struct last_frame {
+    int valid;
+    unsigned int dwell_us;
+    unsigned long long intended, actual;
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig) {
+    stop = 1;
+}
+
+// Files a signed error in ns under its size in us, counting early ones.
+static void hist_add(struct hist *h, long long err) {
+    unsigned long long size = err < 0 ? -err : err, us = size / 1000;
+    int b = 0;
+
+    while (us && b < BUCKETS - 1) {
+        us >>= 1;
+        ++b;
+    }
+    ++h->count[b];
+    ++h->samples;
+    h->total += err;
+    if (size > h->max) h->max = size;
+    if (err < 0) ++h->early;
+}
+
+static void hist_print(const struct hist *h) {
+    unsigned long long most = 0;
+    int b, bar;
+
+    fprintf (stdout, "\n%s: %llu samples, mean %.3f us, max %.3f us, "
+             "%llu early\n", h->name, h->samples,
+             h->samples ? (double)h->total / 1e3 / h->samples : 0.0,
+             h->max / 1e3, h->early);
+    if (!h->samples) return;
+
+    for (b = 0; b < BUCKETS; ++b)
+        if (h->count[b] > most) most = h->count[b];
+    for (b = 0; b < BUCKETS; ++b) {
+        if (!h->count[b]) continue;
+        if (!b)
+            fprintf (stdout, "  %10s us ", "< 1");
+        else if (b == BUCKETS - 1)
+            fprintf (stdout, "  %10s us ", ">= 1048576");
+        else
+            fprintf (stdout, "  %10llu us ", 1ULL << (b - 1));
+        fprintf (stdout, "%10llu ", h->count[b]);
+        for (bar = 0; bar < (int)(h->count[b] * 50 / most); ++bar)
+            fputc('#', stdout);
+        fputc('\n', stdout);
+    }
+}
+
+int main(int argc, char **argv) {
+    const char *path = argc > 1 ? argv[1]
+                                : "/sys/kernel/tracing/trace_pipe";
+    int seconds = argc > 2 ? atoi(argv[2]) : 0;
+    struct hist dwell  = { "dwell error" };
+    struct hist frames = { "frame jitter" };
+    struct hist ticks  = { "tick jitter" };
+    struct hist pauses = { "pause jitter" };
+    struct hist writes = { "write jitter" };
+    struct hist config = { "config jitter" };
+    struct last_frame last[MINORS];
+    struct sigaction sa;
+    unsigned long long intended, actual, skip;
+    unsigned int segments, dwell_us;
+    char line[512], *ev;
+    int minor;
+    FILE *in;
+
+    in = strcmp(path, "-") ? fopen(path, "r") : stdin;
+    if (!in) {
+        perror("traceanalyze opening trace");
+        return -1;
+    }
+
+    // no SA_RESTART, so a signal breaks out of a blocked read
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGALRM, &sa, NULL);
+    if (seconds > 0) alarm(seconds);
+    memset(last, 0, sizeof(last));
+
+    while (!stop && fgets(line, sizeof(line), in)) {
+        if ((ev = strstr(line, "ledlock_frame: "))) {
+            if (sscanf(ev, "ledlock_frame: minor=%d segments=%x dwell_us=%u "
+                       "intended=%llu actual=%llu", &minor, &segments,
+                       &dwell_us, &intended, &actual) != 5 ||
+                minor < 0 || minor >= MINORS)
+                continue;
+            hist_add(&frames, actual - intended);
+
+            // only a frame due just as the last one ended says how long
+            //  that one stayed up, not one after a second's wait or pause
+            if (last[minor].valid && last[minor].dwell_us &&
+                intended == last[minor].intended +
+                            last[minor].dwell_us * 1000ULL)
+                hist_add(&dwell, (long long)(actual - last[minor].actual) -
+                                 last[minor].dwell_us * 1000LL);
+
+            last[minor].valid    = 1;
+            last[minor].dwell_us = dwell_us;
+            last[minor].intended = intended;
+            last[minor].actual   = actual;
+        }
+        else if ((ev = strstr(line, "ledlock_tick: "))) {
+            if (sscanf(ev, "ledlock_tick: minor=%d seconds=%llu "
+                       "intended=%llu actual=%llu", &minor, &skip,
+                       &intended, &actual) == 4)
+                hist_add(&ticks, actual - intended);
+        }
+        else if ((ev = strstr(line, "ledlock_pause: "))) {
+            if (sscanf(ev, "ledlock_pause: minor=%d paused=%u "
+                       "intended=%llu actual=%llu", &minor, &segments,
+                       &intended, &actual) == 4)
+                hist_add(&pauses, actual - intended);
+        }
+        else if ((ev = strstr(line, "ledlock_write: "))) {
+            if (sscanf(ev, "ledlock_write: minor=%d cap=%llu "
+                       "intended=%llu actual=%llu", &minor, &skip,
+                       &intended, &actual) == 4)
+                hist_add(&writes, actual - intended);
+        }
+        else if ((ev = strstr(line, "ledlock_config: "))) {
+            ev = strstr(ev, "intended=");
+            if (ev && sscanf(ev, "intended=%llu actual=%llu", &intended,
+                             &actual) == 2)
+                hist_add(&config, actual - intended);
+        }
+    }
+
+    hist_print(&dwell);
+    hist_print(&frames);
+    hist_print(&ticks);
+    hist_print(&pauses);
+    hist_print(&writes);
+    hist_print(&config);
+
+    if (in != stdin) fclose(in);
+    return 0;
+}